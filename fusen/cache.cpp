@@ -0,0 +1,103 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+#include "metadata.h"
+
+// A non-exact query can only narrow an earlier result if it has the same
+// terms in the same order, every included term still contains the old one
+// and every excluded term is unchanged. Lengthening an excluded term
+// excludes less, so the result could grow.
+static bool is_refinement(const QStringList &old_terms, const QStringList &terms) {
+    if (old_terms.size() != terms.size()) {
+        return false;
+    }
+    for (int i = 0; i < terms.size(); ++i) {
+        const QString &old_term = old_terms.at(i);
+        const QString &term = terms.at(i);
+        // A changed bound (size>1 to size>10) can widen just as well.
+        if (old_term.startsWith('-') || term.startsWith('-') || isMetadataTerm(old_term) || isMetadataTerm(term)) {
+            if (old_term != term) {
+                return false;
+            }
+        } else if (!term.contains(old_term)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// An exact query narrows an earlier one if it keeps all of its terms and
+// only adds more, since every term is intersected or subtracted.
+static bool is_exact_refinement(const QStringList &old_terms, const QStringList &terms) {
+    if (old_terms.size() >= terms.size()) {
+        return false;
+    }
+    for (int i = 0; i < old_terms.size(); ++i) {
+        if (!terms.contains(old_terms.at(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+QueryCache::QueryCache(int capacity) : capacity(capacity) {
+}
+
+void QueryCache::clear() {
+    results.clear();
+}
+
+const queryResult *QueryCache::find(const QStringList &terms, bool exact, uint64_t generation) {
+    for (int i = 0; i < results.size(); ++i) {
+        const queryResult &result = results.at(i);
+        if (result.generation == generation && result.exact == exact && result.terms == terms) {
+            results.move(i, 0);
+            return &results.first();
+        }
+    }
+    return nullptr;
+}
+
+const queryResult *QueryCache::findRefinable(const QStringList &terms, bool exact, uint64_t generation) {
+    // Prefer the smallest candidate set.
+    const queryResult *best = nullptr;
+    for (int i = 0; i < results.size(); ++i) {
+        const queryResult &result = results.at(i);
+        if (result.generation != generation || result.exact != exact) {
+            continue;
+        }
+        if (exact ? !is_exact_refinement(result.terms, terms) : !is_refinement(result.terms, terms)) {
+            continue;
+        }
+        if (!best || result.entries.size() < best->entries.size()) {
+            best = &result;
+        }
+    }
+    return best;
+}
+
+void QueryCache::insert(const QStringList &terms, bool exact, uint64_t generation, const QStringList &entries) {
+    queryResult result;
+    result.terms = terms;
+    result.exact = exact;
+    result.generation = generation;
+    result.entries = entries;
+    results.prepend(result);
+    while (results.size() > capacity) {
+        results.removeLast();
+    }
+}
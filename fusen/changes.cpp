@@ -0,0 +1,122 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <fstream>
+#include <iostream>
+#include <yaml-cpp/yaml.h>
+
+#include "changes.h"
+#include "sql.h"
+#include "trace.h"
+#include "utils.h"
+
+changeCursor parseChangeCursor(const std::string &text) {
+    changeCursor cursor;
+    QStringList parts = QString(text.c_str()).split(',');
+    for (int i = 0; i < parts.size(); ++i) {
+        if (parts.at(i).isEmpty()) {
+            continue;
+        }
+        int colon = parts.at(i).indexOf(':');
+        QString name = colon < 0 ? "main" : parts.at(i).left(colon);
+        cursor.insert(name, parts.at(i).mid(colon + 1).toLongLong());
+    }
+    return cursor;
+}
+
+std::string formatChangeCursor(const changeCursor &cursor) {
+    std::string text = std::to_string(cursor.value("main", 0));
+    QStringList names = cursor.keys();
+    names.sort();
+    for (int i = 0; i < names.size(); ++i) {
+        if (names.at(i) != "main" && cursor.value(names.at(i)) > 0) {
+            text += "," + names.at(i).toStdString() + ":" + std::to_string(cursor.value(names.at(i)));
+        }
+    }
+    return text;
+}
+
+// Writes every change after the given cursor, only the last one of each
+// path and tag, and sets last to the cursor to continue from next time.
+bool exportChangeLog(sqlite3 *database, const std::string &since, const std::string &filename, std::string *last) {
+    TraceScope scope("exportChangeLog");
+    changeCursor end;
+    QList<tagChange> changes = sql_get_changes(database, parseChangeCursor(since), &end);
+
+    YAML::Emitter yaml;
+    yaml << YAML::BeginMap;
+    yaml << YAML::Key << "since" << YAML::Value << formatChangeCursor(parseChangeCursor(since));
+    yaml << YAML::Key << "last" << YAML::Value << formatChangeCursor(end);
+    yaml << YAML::Key << "changes" << YAML::Value << YAML::BeginSeq;
+    for (int i = 0; i < changes.size(); ++i) {
+        const tagChange &change = changes.at(i);
+        yaml << YAML::Flow << YAML::BeginMap;
+        yaml << YAML::Key << "seq" << YAML::Value << change.seq;
+        yaml << YAML::Key << "op" << YAML::Value << (change.add ? "add" : "remove");
+        yaml << YAML::Key << "path" << YAML::Value << change.path.toStdString();
+        if (!change.tag.isEmpty()) {
+            yaml << YAML::Key << "tag" << YAML::Value << change.tag.toStdString();
+        }
+        yaml << YAML::Key << "time" << YAML::Value << change.time;
+        yaml << YAML::EndMap;
+    }
+    yaml << YAML::EndSeq << YAML::EndMap;
+
+    std::ofstream fout(filename.c_str());
+    fout << yaml.c_str() << std::endl;
+    fout.close();
+    if (!fout) {
+        std::cerr << "Error while writing changes to " << filename << std::endl;
+        return false;
+    }
+    *last = formatChangeCursor(end);
+    return true;
+}
+
+// Paths that aren't here yet are only added under the roots.
+bool importChangeLog(sqlite3 *database, const std::string &filename, QStringList roots, int *applied, int *skipped) {
+    TraceScope scope("importChangeLog");
+    QList<tagChange> changes;
+    try {
+        YAML::Node yaml = YAML::LoadFile(filename);
+        if (!yaml["changes"] || !yaml["changes"].IsSequence()) {
+            std::cerr << "Error while reading changes: " << filename << " has no list of changes" << std::endl;
+            return false;
+        }
+        for (size_t i = 0; i < yaml["changes"].size(); ++i) {
+            YAML::Node node = yaml["changes"][i];
+            if (!node["op"] || !node["path"] || !node["time"]) {
+                continue;
+            }
+            std::string op = node["op"].as<std::string>();
+            if (op != "add" && op != "remove") {
+                continue;
+            }
+            tagChange change;
+            change.add = op == "add";
+            change.path = node["path"].as<std::string>().c_str();
+            change.seq = node["seq"] ? node["seq"].as<int64_t>() : 0;
+            change.tag = node["tag"] ? sanitize_tags(node["tag"].as<std::string>()).c_str() : "";
+            change.time = node["time"].as<int64_t>();
+            changes.append(change);
+        }
+    } catch (const YAML::Exception &e) {
+        std::cerr << "Error while reading changes: " << e.what() << std::endl;
+        return false;
+    }
+    return sql_apply_changes(database, changes, roots, applied, skipped);
+}
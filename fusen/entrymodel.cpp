@@ -0,0 +1,53 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "entrymodel.h"
+
+EntryModel::EntryModel(QObject *parent) : QAbstractListModel(parent), snapshot(nullptr) {
+}
+
+QVariant EntryModel::data(const QModelIndex &index, int role) const {
+    if (!index.isValid() || index.row() >= rowCount() || (role != Qt::DisplayRole && role != Qt::EditRole)) {
+        return QVariant();
+    }
+    return snapshot ? snapshot->path(index.row()) : entries.at(index.row());
+}
+
+int EntryModel::rowCount(const QModelIndex &parent) const {
+    if (parent.isValid()) {
+        return 0;
+    }
+    return snapshot ? snapshot->count() : entries.size();
+}
+
+void EntryModel::setSnapshot(const IndexSnapshot *snapshot) {
+    beginResetModel();
+    entries.clear();
+    this->snapshot = snapshot;
+    endResetModel();
+}
+
+void EntryModel::setStringList(const QStringList &entries) {
+    beginResetModel();
+    this->entries = entries;
+    snapshot = nullptr;
+    endResetModel();
+}
+
+bool EntryModel::showsSnapshot() const {
+    return snapshot != nullptr;
+}
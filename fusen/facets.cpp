@@ -0,0 +1,68 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "facets.h"
+#include "sql.h"
+#include "trace.h"
+
+FacetJob::FacetJob(const QStringList &paths, bool all, int limit, const IndexSnapshot *snapshot)
+    : all(all), cancelled(false), limit(limit), paths(paths), snapshot(snapshot) {
+}
+
+void FacetJob::cancel() {
+    cancelled.store(true);
+}
+
+bool FacetJob::isCancelled() const {
+    return cancelled.load();
+}
+
+QList<QPair<int, QString>> FacetJob::result() const {
+    return facets;
+}
+
+void FacetJob::run(sqlite3 *database) {
+    if (cancelled.load()) {
+        return;
+    }
+    TraceScope scope("FacetJob::run");
+    if (snapshot) {
+        facets = snapshot->countTags(paths, all, limit, &cancelled);
+    } else {
+        facets = sql_count_tags(database, paths, all, limit, &cancelled);
+    }
+}
+
+FacetCounter::FacetCounter(ThreadPool *pool) : pool(pool) {
+    database = connectDatabase();
+}
+
+FacetCounter::~FacetCounter() {
+    sqlite3_close(database);
+}
+
+void FacetCounter::start(std::shared_ptr<FacetJob> job, std::function<void()> finished) {
+    pool->submit([this, job, finished] {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job->run(database);
+        }
+        if (!job->isCancelled()) {
+            finished();
+        }
+    });
+}
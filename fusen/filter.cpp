@@ -0,0 +1,95 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "filter.h"
+#include "trace.h"
+
+// Number of paths per chunk. Small enough that a chunk of QStrings plus
+// their data stays in a core's cache and the first chunk comes back fast.
+#define FILTER_CHUNK_SIZE 8192
+
+FilterJob::FilterJob(const QStringList &candidates, const QStringList &terms, bool exact)
+    : candidates(candidates), cancelled(false), exact(exact), matcher(exact ? QStringList() : terms), nextChunk(0),
+      terms(terms) {
+    size_t chunks = (candidates.size() + FILTER_CHUNK_SIZE - 1) / FILTER_CHUNK_SIZE;
+    finished.resize(chunks, 0);
+    results.resize(chunks);
+}
+
+void FilterJob::cancel() {
+    cancelled.store(true);
+}
+
+void FilterJob::evaluate(size_t chunk) {
+    if (cancelled.load()) {
+        return;
+    }
+    TraceScope scope("FilterJob::evaluate");
+    size_t begin = chunk * FILTER_CHUNK_SIZE;
+    size_t end = std::min(begin + FILTER_CHUNK_SIZE, static_cast<size_t>(candidates.size()));
+    // Without any terms everything matches.
+    bool everything = terms.isEmpty();
+    QStringList matches;
+    for (size_t i = begin; i < end; ++i) {
+        const QString &path = candidates.at(i);
+        if (everything || (!exact && matcher.matches(path)) || tagEntries.contains(path)) {
+            matches.append(path);
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    results[chunk] = matches;
+    finished[chunk] = 1;
+}
+
+// The chunks wait for the tags, which are only looked up if there is
+// anything to filter.
+void FilterJob::start(ThreadPool *pool, ShardSet *shards, std::function<void()> chunkFinished) {
+    if (terms.isEmpty() || candidates.isEmpty()) {
+        filter(pool, chunkFinished);
+        return;
+    }
+    std::shared_ptr<FilterJob> job = shared_from_this();
+    shards->start(terms, exact, &cancelled, [job, pool, chunkFinished](QSet<QString> entries) {
+        job->tagEntries.swap(entries);
+        job->filter(pool, chunkFinished);
+    });
+}
+
+void FilterJob::filter(ThreadPool *pool, std::function<void()> chunkFinished) {
+    std::shared_ptr<FilterJob> job = shared_from_this();
+    for (size_t i = 0; i < results.size(); ++i) {
+        pool->submit([job, i, chunkFinished] {
+            job->evaluate(i);
+            if (!job->cancelled.load()) {
+                chunkFinished();
+            }
+        });
+    }
+}
+
+// Appends every finished chunk that directly follows the ones already
+// taken. Returns true once all chunks have been taken.
+bool FilterJob::takeReady(QStringList &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (nextChunk < results.size() && finished[nextChunk]) {
+        out += results[nextChunk];
+        results[nextChunk].clear();
+        ++nextChunk;
+    }
+    return nextChunk == results.size();
+}
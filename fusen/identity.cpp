@@ -0,0 +1,289 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xxhash.h>
+
+#include "identity.h"
+#include "sql.h"
+#include "trace.h"
+
+// Size of the head and tail blocks that make up the quick hash.
+#define IDENTITY_BLOCK_SIZE 65536
+
+// Number of files hashed by a single pool task.
+#define IDENTITY_BATCH_SIZE 64
+
+typedef QPair<int64_t, uint64_t> identityKey;
+
+bool hashFile(const std::string &path, bool full, fileIdentity *identity) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    // Empty files all look the same so they can't be told apart anyway.
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    // Only the pages that are actually hashed get faulted in.
+    const char *data = static_cast<const char *>(map);
+    size_t head = std::min(size, static_cast<size_t>(IDENTITY_BLOCK_SIZE));
+    size_t tail = std::min(size - head, static_cast<size_t>(IDENTITY_BLOCK_SIZE));
+    identity->size = size;
+    identity->quick = XXH3_64bits_withSeed(data, head, size);
+    if (tail) {
+        identity->quick ^= XXH3_64bits_withSeed(data + size - tail, tail, ~identity->quick);
+    }
+    identity->full = 0;
+    if (full) {
+        madvise(map, size, MADV_SEQUENTIAL);
+        identity->full = XXH3_64bits(data, size);
+        // Zero means "not computed".
+        if (identity->full == 0) {
+            identity->full = 1;
+        }
+    }
+    munmap(map, size);
+    return true;
+}
+
+QHash<QString, fileIdentity> hashFiles(ThreadPool *pool, QStringList paths) {
+    TraceScope scope("hashFiles");
+    std::vector<fileIdentity> identities(paths.size());
+    std::vector<char> valid(paths.size(), 0);
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t remaining = (paths.size() + IDENTITY_BATCH_SIZE - 1) / IDENTITY_BATCH_SIZE;
+    for (int begin = 0; begin < paths.size(); begin += IDENTITY_BATCH_SIZE) {
+        int end = std::min(begin + IDENTITY_BATCH_SIZE, static_cast<int>(paths.size()));
+        pool->submit([&, begin, end] {
+            for (int i = begin; i < end; ++i) {
+                valid[i] = hashFile(paths.at(i).toStdString(), false, &identities[i]);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--remaining == 0) {
+                cond.notify_one();
+            }
+        });
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&] { return remaining == 0; });
+
+    QHash<QString, fileIdentity> result;
+    for (int i = 0; i < paths.size(); ++i) {
+        if (valid[i]) {
+            result.insert(paths.at(i), identities[i]);
+        }
+    }
+    return result;
+}
+
+static uint64_t full_hash(const QString &path, QHash<QString, uint64_t> &cache) {
+    auto it = cache.find(path);
+    if (it != cache.end()) {
+        return it.value();
+    }
+    fileIdentity identity;
+    uint64_t hash = hashFile(path.toStdString(), true, &identity) ? identity.full : 0;
+    cache.insert(path, hash);
+    return hash;
+}
+
+QList<QPair<QString, QString>> findMovedFiles(sqlite3 *database, ThreadPool *pool, QStringList missing, QStringList added) {
+    TraceScope scope("findMovedFiles");
+    QList<QPair<QString, QString>> moves;
+    if (missing.isEmpty() || added.isEmpty()) {
+        return moves;
+    }
+
+    QHash<QString, fileIdentity> old_identities = sql_get_identities(database, missing);
+    if (old_identities.isEmpty()) {
+        return moves;
+    }
+
+    QHash<QString, fileIdentity> new_identities = hashFiles(pool, added);
+    QMultiHash<identityKey, QString> candidates;
+    for (auto it = new_identities.begin(); it != new_identities.end(); ++it) {
+        candidates.insert(identityKey(it->size, it->quick), it.key());
+    }
+
+    QHash<QString, uint64_t> full_hashes;
+    for (auto it = old_identities.begin(); it != old_identities.end(); ++it) {
+        QList<QString> matches = candidates.values(identityKey(it->size, it->quick));
+        if (matches.isEmpty()) {
+            continue;
+        }
+        // Without a full hash of the old file (it only has one if it
+        // collided with something) there is no way to choose between
+        // several candidates.
+        QString match;
+        if (it->full) {
+            for (int i = 0; i < matches.size(); ++i) {
+                if (full_hash(matches.at(i), full_hashes) == it->full) {
+                    match = matches.at(i);
+                    break;
+                }
+            }
+        } else if (matches.size() == 1) {
+            match = matches.first();
+        }
+        if (!match.isEmpty()) {
+            moves.append(QPair<QString, QString>(it.key(), match));
+            candidates.remove(identityKey(it->size, it->quick), match);
+        }
+    }
+    return moves;
+}
+
+// Files that couldn't be hashed (empty or unreadable) are stored with an
+// empty identity so they aren't tried again.
+static void store_identities(sqlite3 *database, const QStringList &paths, QHash<QString, fileIdentity> identities) {
+
+    // Files that share a quick identity, either with each other or with
+    // something already stored, all get a full hash so a later move can
+    // still be resolved.
+    QMultiHash<identityKey, QString> batch;
+    for (auto it = identities.begin(); it != identities.end(); ++it) {
+        batch.insert(identityKey(it->size, it->quick), it.key());
+    }
+    QHash<QString, uint64_t> full_hashes;
+    QHash<QString, fileIdentity> stored_updates;
+    for (auto it = identities.begin(); it != identities.end(); ++it) {
+        QHash<QString, fileIdentity> stored = sql_find_identities(database, it->size, it->quick);
+        stored.remove(it.key());
+        if (stored.isEmpty() && batch.count(identityKey(it->size, it->quick)) == 1) {
+            continue;
+        }
+        it->full = full_hash(it.key(), full_hashes);
+        for (auto s = stored.begin(); s != stored.end(); ++s) {
+            if (!s->full && !identities.contains(s.key())) {
+                s->full = full_hash(s.key(), full_hashes);
+                if (s->full) {
+                    stored_updates.insert(s.key(), s.value());
+                }
+            }
+        }
+    }
+    identities.insert(stored_updates);
+    for (int i = 0; i < paths.size(); ++i) {
+        if (!identities.contains(paths.at(i))) {
+            identities.insert(paths.at(i), fileIdentity{0, 0, 0});
+        }
+    }
+    sql_set_identities(database, identities);
+}
+
+void updateIdentities(sqlite3 *database, ThreadPool *pool, QStringList paths) {
+    TraceScope scope("updateIdentities");
+    if (paths.isEmpty()) {
+        return;
+    }
+    store_identities(database, paths, hashFiles(pool, paths));
+}
+
+IdentityBackfill::IdentityBackfill(ThreadPool *pool)
+    : cancelled(false), done(0), next(0), pool(pool), running(false) {
+    database = connectDatabase();
+}
+
+// The pool has to be gone (or done with every batch) by now.
+IdentityBackfill::~IdentityBackfill() {
+    sqlite3_close(database);
+}
+
+void IdentityBackfill::cancel() {
+    cancelled.store(true);
+}
+
+bool IdentityBackfill::isRunning() const {
+    return running.load();
+}
+
+void IdentityBackfill::start(std::function<void(int, int)> progress) {
+    if (running.exchange(true)) {
+        return;
+    }
+    cancelled.store(false);
+    this->progress = progress;
+    pool->submit([this] {
+        std::lock_guard<std::mutex> lock(mutex);
+        paths = sql_get_unidentified_paths(database);
+        done = 0;
+        next = 0;
+        if (paths.isEmpty()) {
+            running.store(false);
+            return;
+        }
+        this->progress(0, paths.size());
+        for (int i = 0; i < pool->size() && i * IDENTITY_BATCH_SIZE < paths.size(); ++i) {
+            pool->submit([this] { runBatch(); });
+        }
+    });
+}
+
+// Hashing happens outside of the lock, so the batches in flight only take
+// turns on the connection.
+void IdentityBackfill::runBatch() {
+    QStringList batch;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cancelled.load()) {
+            running.store(false);
+            return;
+        }
+        if (next >= paths.size()) {
+            return;
+        }
+        batch = paths.mid(next, IDENTITY_BATCH_SIZE);
+        next += batch.size();
+    }
+    TraceScope scope("IdentityBackfill::runBatch");
+    QHash<QString, fileIdentity> identities;
+    for (int i = 0; i < batch.size() && !cancelled.load(); ++i) {
+        fileIdentity identity;
+        if (hashFile(batch.at(i).toStdString(), false, &identity)) {
+            identities.insert(batch.at(i), identity);
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cancelled.load()) {
+        running.store(false);
+        return;
+    }
+    store_identities(database, batch, identities);
+    done += batch.size();
+    progress(done, paths.size());
+    if (done == paths.size()) {
+        paths.clear();
+        running.store(false);
+    } else if (next < paths.size()) {
+        pool->submit([this] { runBatch(); });
+    }
+}
@@ -0,0 +1,96 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QGridLayout>
+#include <QPushButton>
+
+#include "implications.h"
+#include "sql.h"
+#include "utils.h"
+
+ImplicationsWidget::ImplicationsWidget(sqlite3 *dbase, TagWriter *writer, QWidget *parent) : QWidget(parent) {
+    database = dbase;
+    tagWriter = writer;
+
+    implicationDialog = new QDialog(this);
+    implicationList = new QListWidget(this);
+    refresh();
+
+    tagEdit = new QLineEdit(this);
+    tagEdit->setPlaceholderText(tr("Tag"));
+    impliedEdit = new QLineEdit(this);
+    impliedEdit->setPlaceholderText(tr("Implies"));
+
+    QPushButton *addImplication = new QPushButton("Add Rule", this);
+    QPushButton *removeImplication = new QPushButton("Remove Rule", this);
+    QPushButton *cancel = new QPushButton("Close", this);
+    connect(addImplication, &QPushButton::released, this, &ImplicationsWidget::addImplication);
+    connect(removeImplication, &QPushButton::released, this, &ImplicationsWidget::removeImplication);
+    connect(cancel, &QPushButton::released, this, &ImplicationsWidget::cancel);
+
+    QGridLayout *layout = new QGridLayout();
+    layout->addWidget(implicationList, 0, 0, 1, 3);
+    layout->addWidget(tagEdit, 1, 0);
+    layout->addWidget(impliedEdit, 1, 1);
+    layout->addWidget(addImplication, 1, 2);
+    layout->addWidget(removeImplication, 2, 1);
+    layout->addWidget(cancel, 2, 2);
+    implicationDialog->setLayout(layout);
+
+    implicationDialog->setWindowTitle("Tag Implications");
+    implicationDialog->show();
+}
+
+void ImplicationsWidget::addImplication() {
+    QString tag = sanitize_tags(tagEdit->text().trimmed().toStdString()).c_str();
+    QString implied = sanitize_tags(impliedEdit->text().trimmed().toStdString()).c_str();
+    if (tag.isEmpty() || implied.isEmpty()) {
+        return;
+    }
+    // Rules are written to main, which the tag writer must not be holding
+    // at the same time.
+    tagWriter->flush();
+    if (sql_add_implication(database, tag, implied)) {
+        tagEdit->clear();
+        impliedEdit->clear();
+        refresh();
+    }
+}
+
+void ImplicationsWidget::cancel() {
+    implicationDialog->close();
+}
+
+void ImplicationsWidget::refresh() {
+    implicationList->clear();
+    QList<QPair<QString, QString>> implications = sql_get_implications(database);
+    for (int i = 0; i < implications.size(); ++i) {
+        QListWidgetItem *item = new QListWidgetItem(implications.at(i).first + " ⇒ " + implications.at(i).second,
+                                                    implicationList);
+        item->setData(Qt::UserRole, implications.at(i).first);
+        item->setData(Qt::UserRole + 1, implications.at(i).second);
+    }
+}
+
+void ImplicationsWidget::removeImplication() {
+    QListWidgetItem *item = implicationList->currentItem();
+    if (!item) {
+        return;
+    }
+    tagWriter->flush();
+    sql_remove_implication(database, item->data(Qt::UserRole).toString(), item->data(Qt::UserRole + 1).toString());
+    refresh();
+}
@@ -0,0 +1,223 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <QFileInfo>
+#include <QProcess>
+
+#include "launcher.h"
+
+extern char **environ;
+
+static std::string escape_json(const std::string &str) {
+    std::string escaped;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// One socket per running fusen, so that two of them never hand files to
+// each other's mpv.
+static std::string mpv_socket_path() {
+    std::string name = "fusen-mpv-" + std::to_string(getpid()) + ".sock";
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && runtime[0]) {
+        return std::string(runtime) + "/" + name;
+    }
+    return "/tmp/" + std::to_string(getuid()) + "-" + name;
+}
+
+Launcher::Launcher(mainSettings *settings) : mpvPid(-1), settings(settings) {
+    mpvSocket = mpv_socket_path();
+    reaper = new QTimer();
+    reaper->setInterval(1000);
+    QObject::connect(reaper, &QTimer::timeout, [this] { reapChildren(); });
+}
+
+Launcher::~Launcher() {
+    // Viewers are left running; init reaps them once fusen is gone.
+    delete reaper;
+}
+
+QString Launcher::handlerFor(const QString &file) {
+    if (settings->mimeHandlers.isEmpty()) {
+        return settings->defaultApplicationPath.c_str();
+    }
+
+    // Looking up by extension alone is enough here and it means the lookup
+    // only has to happen once per extension instead of once per file.
+    QString suffix = QFileInfo(file).suffix().toLower();
+    auto it = mimeCache.find(suffix);
+    if (it == mimeCache.end()) {
+        QMimeType mime = mimeDatabase.mimeTypeForFile(file, QMimeDatabase::MatchExtension);
+        it = mimeCache.insert(suffix, mime.name());
+    }
+
+    const QString &name = it.value();
+    if (settings->mimeHandlers.contains(name)) {
+        return settings->mimeHandlers.value(name);
+    }
+    QString wildcard = name.section('/', 0, 0) + "/*";
+    if (settings->mimeHandlers.contains(wildcard)) {
+        return settings->mimeHandlers.value(wildcard);
+    }
+    return settings->defaultApplicationPath.c_str();
+}
+
+void Launcher::launch(const QString &command, const QStringList &files) {
+    QStringList argv = QProcess::splitCommand(command);
+    if (argv.isEmpty()) {
+        std::cerr << "No application set to open files with!" << std::endl;
+        return;
+    }
+
+    bool mpv = QFileInfo(argv.first()).fileName() == "mpv";
+    int sent = mpv ? sendToMpv(files) : 0;
+    if (sent == files.size()) {
+        return;
+    }
+    if (mpv) {
+        argv.append(QString("--input-ipc-server=") + mpvSocket.c_str());
+    }
+    argv += files.mid(sent);
+    pid_t pid = spawn(argv);
+    if (mpv && pid > 0) {
+        mpvPid = pid;
+    }
+}
+
+void Launcher::openFiles(const QStringList &files) {
+    // Keep the selection order within every handler.
+    QStringList commands;
+    QHash<QString, QStringList> groups;
+    for (int i = 0; i < files.size(); ++i) {
+        QString command = handlerFor(files.at(i));
+        if (!groups.contains(command)) {
+            commands.append(command);
+        }
+        groups[command].append(files.at(i));
+    }
+    for (int i = 0; i < commands.size(); ++i) {
+        launch(commands.at(i), groups.value(commands.at(i)));
+    }
+}
+
+void Launcher::openFilesWith(const QString &command, const QStringList &files) {
+    launch(command, files);
+}
+
+void Launcher::reapChildren() {
+    for (auto it = children.begin(); it != children.end();) {
+        int status;
+        pid_t ret = waitpid(*it, &status, WNOHANG);
+        if (ret == 0) {
+            ++it;
+            continue;
+        }
+        if (*it == mpvPid) {
+            mpvPid = -1;
+        }
+        it = children.erase(it);
+    }
+    if (children.empty()) {
+        reaper->stop();
+    }
+}
+
+// Returns how many of the files (from the front) mpv got. mpv ignores a
+// command cut off in the middle, so only whole lines count.
+int Launcher::sendToMpv(const QStringList &files) {
+    reapChildren();
+    if (mpvPid <= 0) {
+        return 0;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return 0;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, mpvSocket.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    std::string commands;
+    std::vector<size_t> ends;
+    for (int i = 0; i < files.size(); ++i) {
+        commands += "{\"command\":[\"loadfile\",\"" + escape_json(files.at(i).toStdString()) + "\",\"append-play\"]}\n";
+        ends.push_back(commands.size());
+    }
+    size_t written = 0;
+    while (written < commands.size()) {
+        // Don't get killed by SIGPIPE if mpv is just shutting down.
+        ssize_t ret = send(fd, commands.data() + written, commands.size() - written, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += ret;
+    }
+    close(fd);
+    return std::upper_bound(ends.begin(), ends.end(), written) - ends.begin();
+}
+
+pid_t Launcher::spawn(const QStringList &argv) {
+    std::vector<std::string> args;
+    for (int i = 0; i < argv.size(); ++i) {
+        args.push_back(argv.at(i).toStdString());
+    }
+    std::vector<char *> c_args;
+    for (std::string &arg : args) {
+        c_args.push_back(&arg[0]);
+    }
+    c_args.push_back(nullptr);
+
+    pid_t pid;
+    int ret = posix_spawnp(&pid, c_args[0], NULL, NULL, c_args.data(), environ);
+    if (ret != 0) {
+        std::cerr << "Error while trying to open files with " << args[0] << ": " << strerror(ret) << std::endl;
+        return -1;
+    }
+    children.push_back(pid);
+    if (!reaper->isActive()) {
+        reaper->start();
+    }
+    return pid;
+}
@@ -15,8 +15,13 @@
  */
 
 #include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <mutex>
 #include <QApplication>
 #include <QClipboard>
 #include <QFileDialog>
@@ -24,19 +29,114 @@
 #include <QLabel>
 #include <QListView>
 #include <QMenuBar>
+#include <QMessageBox>
 #include <QPushButton>
+#include <QStatusBar>
+#include <QTimer>
+#include <sys/stat.h>
 #include <yaml-cpp/yaml.h>
 
+#include "changes.h"
+#include "facets.h"
+#include "identity.h"
+#include "implications.h"
+#include "maintenance.h"
 #include "mainwindow.h"
+#include "match.h"
 #include "scandirs.h"
+#include "shards.h"
+#include "snapshot.h"
 #include "sql.h"
+#include "trace.h"
 #include "utils.h"
 
 namespace fs = std::filesystem;
 
+// How many facets to show.
+#define FACET_LIMIT 20
+
+// Maintenance waits until nothing happened for a while, then works in
+// short slices with gaps between them and starts over after the interval.
+#define MAINTENANCE_IDLE_DELAY 10000
+#define MAINTENANCE_INTERVAL 300000
+#define MAINTENANCE_SLICE 20000000
+#define MAINTENANCE_SLICE_GAP 10
+
+// "fusen export [--since CURSOR] FILE" writes the changes since the last
+// export (or CURSOR) and prints the cursor to continue from next time,
+// "fusen import FILE" applies them. This way syncing can be scripted. "fusen
+// maintain" runs a full maintenance round, e.g. from cron.
+static void printStats(const QList<databaseStats> &list) {
+    for (int i = 0; i < list.size(); ++i) {
+        const databaseStats &stats = list.at(i);
+        std::cout << stats.schema.toStdString() << ": " << stats.pages * stats.pageSize / 1024 << " KiB, "
+                  << stats.freePages * stats.pageSize / 1024 << " KiB free"
+                  << (stats.incremental ? "" : ", not incremental") << std::endl;
+    }
+}
+
+static QStringList readScanDirs(const YAML::Node &yaml) {
+    QStringList dirs;
+    if (yaml["scanDirectories"] && yaml["scanDirectories"].IsSequence()) {
+        for (size_t i = 0; i < yaml["scanDirectories"].size(); ++i) {
+            dirs.append(yaml["scanDirectories"][i].as<std::string>().c_str());
+        }
+    }
+    return dirs;
+}
+
+static int runCommand(int argc, char *argv[]) {
+    sqlite3 *database = connectDatabase();
+    // Edits left in the journal by a crash go in first, unless the window
+    // is open and still writing to it.
+    TagWriter *tagWriter = new TagWriter;
+    delete tagWriter;
+
+    int status = EXIT_SUCCESS;
+    std::string command = argv[1];
+    if (command == "export" && (argc == 3 || (argc == 5 && strcmp(argv[2], "--since") == 0))) {
+        std::string since = argc == 5 ? argv[3] : sql_get_meta_text(database, "exported");
+        std::string last;
+        if (!exportChangeLog(database, since, argv[argc - 1], &last)) {
+            status = EXIT_FAILURE;
+        } else {
+            sql_set_meta_text(database, "exported", last);
+            std::cout << last << std::endl;
+        }
+    } else if (command == "import" && argc == 3) {
+        fs::path file = getUserFile("settings");
+        QStringList roots = fs::exists(file) ? readScanDirs(YAML::LoadFile(file.string())) : QStringList();
+        int applied, skipped;
+        if (importChangeLog(database, argv[2], roots, &applied, &skipped)) {
+            std::cout << "Applied " << applied << " changes, skipped " << skipped
+                      << " older than local ones or outside the scan directories." << std::endl;
+        } else {
+            status = EXIT_FAILURE;
+        }
+    } else if (command == "maintain" && argc == 2) {
+        Maintenance maintenance;
+        printStats(maintenance.stats());
+        maintenance.finish();
+        printStats(maintenance.stats());
+    } else {
+        std::cerr << "Usage: fusen export [--since CURSOR] FILE" << std::endl;
+        std::cerr << "       fusen import FILE" << std::endl;
+        std::cerr << "       fusen maintain" << std::endl;
+        status = EXIT_FAILURE;
+    }
+    sqlite3_close(database);
+    return status;
+}
+
 int main(int argc, char *argv[]) {
+    if (argc > 1 && (strcmp(argv[1], "export") == 0 || strcmp(argv[1], "import") == 0 ||
+                     strcmp(argv[1], "maintain") == 0)) {
+        return runCommand(argc, argv);
+    }
+
     QApplication app(argc, argv);
     std::setlocale(LC_NUMERIC, "C");
+    trace_init();
 
     MainWindow window;
     window.show();
@@ -45,6 +145,7 @@ int main(int argc, char *argv[]) {
 }
 
 QStringList build_entries(sqlite3 *database) {
+    TraceScope scope("build_entries");
     QSet<QString> entries = sql_get_paths(database);
     QStringList list(entries.begin(), entries.end());
     return list;
@@ -59,7 +160,8 @@ static QStringList getSelectedFiles(QListView *listView) {
     return list;
 }
 
-static void initializeSettings(sqlite3 *database, mainSettings *settings) {
+static void initializeSettings(sqlite3 *database, mainSettings *settings, ThreadPool *pool) {
+    TraceScope scope("initializeSettings");
     fs::path file = getUserFile("settings");
     if (!fs::exists(file)) {
         fs::create_directories(file.parent_path());
@@ -78,37 +180,123 @@ static void initializeSettings(sqlite3 *database, mainSettings *settings) {
     if (yaml["deleteFileAfterImport"]) {
         settings->deleteImport->setChecked(yaml["deleteFileAfterImport"].as<bool>());
     }
-    if (yaml["scanDirectories"] && yaml["scanDirectories"].IsSequence()) {
-        for (size_t i = 0; i < yaml["scanDirectories"].size(); ++i) {
-            settings->scanDirs.append(yaml["scanDirectories"][i].as<std::string>().c_str());
+    if (yaml["mimeHandlers"] && yaml["mimeHandlers"].IsMap()) {
+        for (YAML::const_iterator it = yaml["mimeHandlers"].begin(); it != yaml["mimeHandlers"].end(); ++it) {
+            settings->mimeHandlers.insert(it->first.as<std::string>().c_str(), it->second.as<std::string>().c_str());
+        }
+    }
+    if (yaml["shardDatabases"]) {
+        settings->shardDatabases->setChecked(yaml["shardDatabases"].as<bool>());
+    }
+    if (yaml["showPerformanceOverlay"]) {
+        settings->perfOverlay->setChecked(yaml["showPerformanceOverlay"].as<bool>());
+    }
+    if (yaml["trackFileIdentity"]) {
+        settings->trackIdentity->setChecked(yaml["trackFileIdentity"].as<bool>());
+    }
+    settings->scanDirs = readScanDirs(yaml);
+    if (yaml["scanRules"] && yaml["scanRules"].IsMap()) {
+        for (YAML::const_iterator it = yaml["scanRules"].begin(); it != yaml["scanRules"].end(); ++it) {
+            scanRules rules;
+            for (size_t i = 0; it->second["exclude"] && i < it->second["exclude"].size(); ++i) {
+                rules.exclude.append(it->second["exclude"][i].as<std::string>().c_str());
+            }
+            for (size_t i = 0; it->second["include"] && i < it->second["include"].size(); ++i) {
+                rules.include.append(it->second["include"][i].as<std::string>().c_str());
+            }
+            settings->scanDirRules.insert(it->first.as<std::string>().c_str(), rules);
+        }
+    }
+
+    // A shard whose directory is missing or empty is most likely just not
+    // mounted right now, so its files are neither pruned nor rescanned.
+    QStringList offline;
+    QStringList shard_roots = sql_get_shard_roots();
+    for (int i = 0; i < shard_roots.size(); ++i) {
+        std::error_code ec;
+        fs::path root = shard_roots.at(i).toStdString();
+        if (!fs::exists(root, ec) || fs::is_empty(root, ec) || ec) {
+            offline.append(shard_roots.at(i) + "/");
         }
     }
 
     QSet<QString> existing_files = sql_get_paths(database);
-    // Remove files that no longer exist from the sql.
+    // Remove files that no longer exist from the sql. Every file is looked
+    // at anyway, so the stored metadata of files that changed (or that
+    // were added before it was recorded) is refreshed along the way.
+    QHash<QString, fileMetadata> stored_metadata = sql_get_metadata(database);
+    QHash<QString, fileMetadata> changed_metadata;
     QStringList nonexisting_files;
     for (auto i = existing_files.begin(), end = existing_files.end(); i != end; ++i) {
         QString filename = *i;
-        fs::path file = fs::path(filename.toStdString());
-        if (!fs::exists(file)) {
-            nonexisting_files.append(filename);
+        if (!offline.isEmpty() && std::any_of(offline.begin(), offline.end(),
+                                              [&](const QString &root) { return filename.startsWith(root); })) {
+            continue;
+        }
+        struct stat st;
+        if (stat(filename.toStdString().c_str(), &st) < 0) {
+            if (errno == ENOENT || errno == ENOTDIR) {
+                nonexisting_files.append(filename);
+            }
+            continue;
+        }
+        auto stored = stored_metadata.constFind(filename);
+        if (stored == stored_metadata.constEnd() || stored->size != st.st_size || stored->mtime != st.st_mtim.tv_sec) {
+            fileMetadata metadata;
+            metadata.size = st.st_size;
+            metadata.mtime = st.st_mtim.tv_sec;
+            metadata.type = stored == stored_metadata.constEnd() ? typeClass(filename) : stored->type;
+            changed_metadata.insert(filename, metadata);
         }
     }
-    if (!nonexisting_files.isEmpty()) {
-        sql_remove_paths(database, nonexisting_files);
-    }
+    sql_set_metadata(database, changed_metadata);
+    QStringList added_files;
+    QStringList scan_dirs;
     for (int i = 0; i < settings->scanDirs.size(); ++i) {
-        scanDirectories(database, settings->scanDirs.at(i), existing_files);
+        if (!offline.contains(settings->scanDirs.at(i) + "/")) {
+            scan_dirs.append(settings->scanDirs.at(i));
+        }
+    }
+    if (shard_roots.isEmpty()) {
+        for (int i = 0; i < scan_dirs.size(); ++i) {
+            scanDirectories(database, scan_dirs.at(i), existing_files, &added_files,
+                            settings->scanDirRules.value(scan_dirs.at(i)));
+        }
+    } else {
+        // Every scan directory writes to its own database, so they can all
+        // be scanned at once, each with a connection of its own.
+        std::mutex mutex;
+        std::condition_variable cond;
+        int remaining = scan_dirs.size();
+        for (int i = 0; i < scan_dirs.size(); ++i) {
+            scanRules rules = settings->scanDirRules.value(scan_dirs.at(i));
+            pool->submit([&, i, rules] {
+                sqlite3 *connection = connectDatabase();
+                QStringList added;
+                scanDirectories(connection, scan_dirs.at(i), existing_files, &added, rules);
+                sqlite3_close(connection);
+                std::lock_guard<std::mutex> lock(mutex);
+                added_files += added;
+                if (--remaining == 0) {
+                    cond.notify_one();
+                }
+            });
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return remaining == 0; });
+    }
+    // Missing files that show up again somewhere else keep their tags.
+    if (settings->trackIdentity->isChecked()) {
+        QList<QPair<QString, QString>> moves = findMovedFiles(database, pool, nonexisting_files, added_files);
+        if (sql_move_paths(database, moves)) {
+            for (int i = 0; i < moves.size(); ++i) {
+                nonexisting_files.removeOne(moves.at(i).first);
+            }
+        }
+    }
+    if (!nonexisting_files.isEmpty()) {
+        sql_forget_paths(database, nonexisting_files);
     }
-}
-
-std::string sanitize_tags(std::string str) {
-    // Replace some special characters and other nonsense for sanity
-    // An sql injection is probably still possible but whatever don't make drop table a tag
-    std::replace(str.begin(), str.end(), ' ', '_');
-    std::replace(str.begin(), str.end(), '\'', '_');
-    std::replace(str.begin(), str.end(), '"', '_');
-    return str;
 }
 
 static void saveSettings(mainSettings *settings) {
@@ -116,9 +304,24 @@ static void saveSettings(mainSettings *settings) {
     yaml["clearTagsOnImport"] = settings->clearTags->isChecked();
     yaml["defaultApplicationPath"] = settings->defaultApplicationPath.c_str();
     yaml["deleteFileAfterImport"] = settings->deleteImport->isChecked();
+    for (auto it = settings->mimeHandlers.begin(); it != settings->mimeHandlers.end(); ++it) {
+        yaml["mimeHandlers"][it.key().toStdString()] = it.value().toStdString();
+    }
+    yaml["shardDatabases"] = settings->shardDatabases->isChecked();
+    yaml["showPerformanceOverlay"] = settings->perfOverlay->isChecked();
+    yaml["trackFileIdentity"] = settings->trackIdentity->isChecked();
     for (int i = 0; i < settings->scanDirs.size(); ++i) {
         yaml["scanDirectories"][i] = settings->scanDirs.at(i).toStdString().c_str();
     }
+    for (auto it = settings->scanDirRules.begin(); it != settings->scanDirRules.end(); ++it) {
+        std::string directory = it.key().toStdString();
+        for (int i = 0; i < it->exclude.size(); ++i) {
+            yaml["scanRules"][directory]["exclude"][i] = it->exclude.at(i).toStdString();
+        }
+        for (int i = 0; i < it->include.size(); ++i) {
+            yaml["scanRules"][directory]["include"][i] = it->include.at(i).toStdString();
+        }
+    }
 
     fs::path file = getUserFile("settings");
     std::ofstream fout(file.string().c_str());
@@ -141,8 +344,19 @@ static QStringList splitTags(std::string str, char delimeter) {
 }
 
 MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
+    closing = false;
     settings = new mainSettings;
     database = connectDatabase();
+    // Created first so that edits left in the journal by a crash are in
+    // the database before anything reads it.
+    tagWriter = new TagWriter;
+    tagWriter->setCommitted([this](bool ok) {
+        QMetaObject::invokeMethod(this, [this, ok] { tagsCommitted(ok); }, Qt::QueuedConnection);
+    });
+    queryCache = new QueryCache;
+    pool = new ThreadPool;
+    facetCounter = new FacetCounter(pool);
+    identityBackfill = new IdentityBackfill(pool);
 
     QMenu *fileMenu = menuBar()->addMenu(tr("&File"));
 
@@ -158,6 +372,14 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     connect(addRecursiveDirectory, &QAction::triggered, this, [this]{MainWindow::addDirectory(true);});
     fileMenu->addAction(addRecursiveDirectory);
 
+    QAction *exportChanges = new QAction(tr("&Export Changes"), this);
+    connect(exportChanges, &QAction::triggered, this, &MainWindow::exportChanges);
+    fileMenu->addAction(exportChanges);
+
+    QAction *importChanges = new QAction(tr("&Import Changes"), this);
+    connect(importChanges, &QAction::triggered, this, &MainWindow::importChanges);
+    fileMenu->addAction(importChanges);
+
     QMenu *settingsMenu = menuBar()->addMenu(tr("&Settings"));
 
     clearTags = new QAction(tr("&Clear Existing Tags on Import"), this);
@@ -178,15 +400,52 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     connect(addScanDirs, &QAction::triggered, this, &MainWindow::addScanDirs);
     settingsMenu->addAction(addScanDirs);
 
-    initializeSettings(database, settings);
+    QAction *editImplications = new QAction(tr("&Tag Implications"), this);
+    connect(editImplications, &QAction::triggered, this, &MainWindow::editImplications);
+    settingsMenu->addAction(editImplications);
+
+    trackIdentity = new QAction(tr("&Track Files Across Moves"), this);
+    trackIdentity->setCheckable(true);
+    settingsMenu->addAction(trackIdentity);
+    settings->trackIdentity = trackIdentity;
+
+    shardDatabases = new QAction(tr("Separate &Database per Scan Directory"), this);
+    shardDatabases->setCheckable(true);
+    settingsMenu->addAction(shardDatabases);
+    settings->shardDatabases = shardDatabases;
+
+    perfOverlay = new QAction(tr("&Show Performance Overlay"), this);
+    perfOverlay->setCheckable(true);
+    settingsMenu->addAction(perfOverlay);
+    settings->perfOverlay = perfOverlay;
+
+    initializeSettings(database, settings, pool);
+    shards = new ShardSet(database, pool);
+    launcher = new Launcher(settings);
 
     QWidget *centralWidget = new QWidget(this);
     setCentralWidget(centralWidget);
 
-    entries = build_entries(database);
-    model = new QStringListModel(this);
-    entries.sort();
-    model->setStringList(entries);
+    // The snapshot is only used if nothing was written since it was saved,
+    // including whatever initializeSettings just pruned or scanned. The
+    // list is then read straight from it, so nothing is loaded up front.
+    snapshot = new IndexSnapshot;
+    model = new EntryModel(this);
+    if (snapshot->load(getUserFile("snapshot"), sql_get_generation())) {
+        model->setSnapshot(snapshot);
+        // Not loaded until a search needs it, so no generation matches.
+        libraryGeneration = UINT64_MAX;
+    } else {
+        entries = build_entries(database);
+        entries.sort();
+        model->setStringList(entries);
+        library = entries;
+        libraryGeneration = sql_get_generation();
+    }
+    snapshotGeneration = snapshot->generation();
+    snapshotRunning = false;
+    // Only loaded once a search filters or sorts on metadata.
+    metadata = new MetadataColumns;
 
     searchBox = new QLineEdit(this);
     searchBox->setClearButtonEnabled(true);
@@ -233,14 +492,56 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     mainLayout->addWidget(importTags, 0, 2, Qt::AlignLeft);
     mainLayout->addWidget(exportTags, 0, 3, Qt::AlignLeft);
     mainLayout->addWidget(listView, 1, 0, 1, 4);
+
+    facetList = new QListWidget(this);
+    facetList->setMaximumWidth(250);
+    connect(facetList, &QListWidget::itemClicked, this, &MainWindow::refineFacet);
+    mainLayout->addWidget(facetList, 0, 4, 2, 1);
+
+    // Counting facets waits until typing has settled and the list is shown.
+    facetTimer = new QTimer(this);
+    facetTimer->setSingleShot(true);
+    facetTimer->setInterval(100);
+    connect(facetTimer, &QTimer::timeout, this, &MainWindow::updateFacets);
+    facetTimer->start();
+
+    // Maintenance runs on the thread pool while the window sits idle, so
+    // every search or edit pushes it back. Only the timer lives here, the
+    // slices themselves (and the page counts for the overlay) are worked
+    // out in the background.
+    maintenance = new Maintenance;
+    maintenanceRunning = false;
+    maintenanceStats = maintenance->stats();
+    maintenanceTimer = new QTimer(this);
+    maintenanceTimer->setSingleShot(true);
+    connect(maintenanceTimer, &QTimer::timeout, this, &MainWindow::runMaintenance);
+    maintenanceTimer->start(MAINTENANCE_IDLE_DELAY);
+
+    perfLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(perfLabel);
+    connect(perfOverlay, &QAction::toggled, this, &MainWindow::togglePerfOverlay);
+    togglePerfOverlay(perfOverlay->isChecked());
+    connect(shardDatabases, &QAction::toggled, this, &MainWindow::toggleShards);
+
+    // Files found by the scan above (or left over from before) are hashed
+    // in the background.
+    connect(trackIdentity, &QAction::toggled, this, &MainWindow::toggleIdentity);
+    toggleIdentity(trackIdentity->isChecked());
 }
 
 void MainWindow::addDirectory(bool recursive) {
     QSet<QString> existing_files = sql_get_paths(database);
     QString directory = QFileDialog::getExistingDirectory(this, "Add Directory");
-    QStringList filenames = getNewDirectoryFiles(directory, existing_files, recursive);
+    QHash<QString, fileMetadata> metadata;
+    QStringList filenames = getNewDirectoryFiles(directory, existing_files, recursive, &metadata);
     if (!filenames.isEmpty()) {
+        loadEntries();
+        tagWriter->flush();
         if (sql_add_paths(database, filenames)) {
+            sql_set_metadata(database, metadata);
+            if (trackIdentity->isChecked()) {
+                updateIdentities(database, pool, filenames);
+            }
             entries += filenames;
             entries.sort();
             model->setStringList(entries);
@@ -252,14 +553,25 @@ void MainWindow::addFiles() {
     QSet<QString> existing_files = sql_get_paths(database);
     QStringList filenames = QFileDialog::getOpenFileNames(this, "Add Files");
     QStringList filtered_filenames;
+    QHash<QString, fileMetadata> metadata;
     for (int i = 0; i < filenames.size(); ++i) {
         if (!existing_files.contains(filenames.at(i))) {
             filtered_filenames.append(filenames.at(i));
+            fileMetadata file_metadata;
+            if (readMetadata(filenames.at(i), &file_metadata)) {
+                metadata.insert(filenames.at(i), file_metadata);
+            }
         }
     }
 
     if (!filtered_filenames.isEmpty()) {
+        loadEntries();
+        tagWriter->flush();
         if (sql_add_paths(database, filtered_filenames)) {
+            sql_set_metadata(database, metadata);
+            if (trackIdentity->isChecked()) {
+                updateIdentities(database, pool, filtered_filenames);
+            }
             entries += filtered_filenames;
             entries.sort();
             model->setStringList(entries);
@@ -268,40 +580,195 @@ void MainWindow::addFiles() {
 }
 
 void MainWindow::addScanDirs() {
-    new ScanDirsWidget(database, settings, this);
+    new ScanDirsWidget(database, settings, tagWriter, this);
 }
 
 void MainWindow::closeEvent(QCloseEvent *event) {
+    // Join the workers first so nothing posts back to this window anymore.
+    // Calls that were already queued find it closing and do nothing.
+    closing = true;
+    facetTimer->stop();
+    maintenanceTimer->stop();
+    if (filterJob) {
+        filterJob->cancel();
+        filterJob.reset();
+    }
+    if (facetJob) {
+        facetJob->cancel();
+        facetJob.reset();
+    }
+    identityBackfill->cancel();
+    tagWriter->setCommitted(nullptr);
+    delete pool;
+    delete facetCounter;
+    delete identityBackfill;
+    delete shards;
+    delete tagWriter;
+    delete maintenance;
+    // Only whatever was committed since the last idle moment is missing.
+    if (snapshotGeneration != sql_get_generation()) {
+        writeSnapshot(database, getUserFile("snapshot"), sql_get_generation());
+    }
+    model->setStringList(QStringList());
+    delete snapshot;
+    // Switching the layout only takes effect on the next start.
+    sql_set_shards(database, shardDatabases->isChecked() ? settings->scanDirs : QStringList());
     sqlite3_close(database);
     saveSettings(settings);
+    delete launcher;
+    delete metadata;
+    delete queryCache;
     delete settings;
+    trace_write();
 }
 
 void MainWindow::buildEntries(const QString str) {
-    QSet<QString> path_entries;
-    QSet<QString> tag_entries;
+    TraceScope scope("buildEntries");
     bool exact_match = exactMatch->isChecked();
     QStringList tags = splitTags(str.toStdString(), ',');
+    uint64_t generation = sql_get_generation();
+    maintenanceTimer->start(MAINTENANCE_IDLE_DELAY);
+
+    // Metadata terms are answered from the in-memory columns, the rest are
+    // tags (or path names).
+    QStringList tag_terms;
+    metadataQuery query = parseMetadataQuery(tags, &tag_terms);
+    bool use_metadata = !query.filters.isEmpty() || query.sort != FIELD_NONE;
+    if (use_metadata && !metadata->isCurrent(sql_get_metadata_generation())) {
+        metadata->load(database, sql_get_metadata_generation());
+    }
 
-    // If not exact check the path name as well as the actual tags.
-    if (!exact_match) {
-        entries = build_entries(database);
-        for (int i = 0; i < entries.size(); ++i) {
-            for (int j = 0; j < tags.size(); ++j) {
-                if (entries.at(i).toLower().contains(tags.at(j).toLower())) {
-                    path_entries.insert(entries.at(i));
+    // Whatever is still running belongs to an older query.
+    if (filterJob) {
+        filterJob->cancel();
+        filterJob.reset();
+    }
+
+    // Without any terms the snapshot can be shown as it is.
+    bool snapshot_current = snapshot->isValid() && snapshot->generation() == generation;
+    if (tags.isEmpty() && snapshot_current) {
+        entries.clear();
+        model->setSnapshot(snapshot);
+        trace_record_query(scope.elapsed(), snapshot->count());
+        updatePerfOverlay();
+        facetTimer->start();
+        return;
+    }
+
+    const queryResult *cached = queryCache->find(tags, exact_match, generation);
+    if (cached) {
+        entries = cached->entries;
+        trace_counter("query_cache_hit", 1);
+        trace_record_query(scope.elapsed(), entries.size());
+        showEntries();
+        return;
+    }
+
+    // Adding terms to a query only narrows it (this is what clicking a
+    // facet does), so a cached result can be filtered instead of every
+    // path in the database. An exact query then only has to look up the
+    // added terms.
+    const queryResult *previous = queryCache->findRefinable(tags, exact_match, generation);
+    QStringList terms = tag_terms;
+    if (exact_match && previous) {
+        terms.clear();
+        for (int i = 0; i < tag_terms.size(); ++i) {
+            if (!previous->terms.contains(tag_terms.at(i))) {
+                terms.append(tag_terms.at(i));
+            }
+        }
+    }
+
+    // Exact matches are just merges of the snapshot's posting lists as
+    // long as it is still current.
+    if (exact_match && (snapshot_current || (previous && terms.isEmpty()))) {
+        QStringList matches;
+        if (previous && terms.isEmpty()) {
+            matches = previous->entries;
+        } else {
+            matches = snapshot->exactMatch(terms);
+            trace_record_query(scope.elapsed(), matches.size());
+        }
+        if (previous) {
+            QSet<QString> match_set(matches.begin(), matches.end());
+            entries.clear();
+            for (int i = 0; i < previous->entries.size(); ++i) {
+                if (match_set.contains(previous->entries.at(i))) {
+                    entries.append(previous->entries.at(i));
                 }
             }
+        } else {
+            entries = matches;
+        }
+        if (use_metadata) {
+            metadata->apply(entries, query);
+        }
+        queryCache->insert(tags, exact_match, generation, entries);
+        showEntries();
+        return;
+    }
+
+    // Everything else is filtered in the background, tag lookup included.
+    // If not exact the path name is checked as well as the actual tags.
+    // The candidates are sorted so the filtered chunks can be shown as
+    // soon as they are done.
+    if (!previous && libraryGeneration != generation) {
+        if (snapshot_current) {
+            library = snapshot->paths();
+        } else {
+            library = build_entries(database);
+            library.sort();
         }
+        libraryGeneration = generation;
     }
+    QStringList candidates = previous ? previous->entries : library;
+    // Metadata filters are cheap, so they go first and leave less to
+    // match. Sorting has to wait for the complete result.
+    metadataQuery filters = query;
+    filters.sort = FIELD_NONE;
+    metadata->apply(candidates, filters);
+
+    std::shared_ptr<FilterJob> job = std::make_shared<FilterJob>(candidates, terms, exact_match);
+    filterJob = job;
+    filterExact = exact_match;
+    filterGeneration = generation;
+    filterQuery = query;
+    filterShown = false;
+    filterTerms = tags;
+    entries.clear();
+    job->start(pool, shards, [this, job] {
+        QMetaObject::invokeMethod(this, [this, job] { collectEntries(job); }, Qt::QueuedConnection);
+    });
+    collectEntries(job);
+}
 
-    tag_entries = sql_update_entries(database, tags, exact_match);
-    QSet<QString> filtered_entries = path_entries + tag_entries;
+void MainWindow::collectEntries(std::shared_ptr<FilterJob> job) {
+    if (job != filterJob) {
+        return;
+    }
 
-    QStringList filtered_list(filtered_entries.begin(), filtered_entries.end());
-    entries = filtered_list;
-    entries.sort();
-    model->setStringList(entries);
+    if (!job->takeReady(entries)) {
+        // Show the first screen of matches without waiting for the rest.
+        if (!filterShown && !entries.isEmpty() && filterQuery.sort == FIELD_NONE) {
+            model->setStringList(entries);
+            filterShown = true;
+        }
+        return;
+    }
+
+    filterJob.reset();
+    if (filterGeneration != sql_get_generation()) {
+        // The database changed while filtering so start over.
+        buildEntries(searchBox->text());
+        return;
+    }
+    if (filterQuery.sort != FIELD_NONE) {
+        metadataQuery sort = filterQuery;
+        sort.filters.clear();
+        metadata->apply(entries, sort);
+    }
+    queryCache->insert(filterTerms, filterExact, filterGeneration, entries);
+    showEntries();
 }
 
 void MainWindow::copyPath() {
@@ -330,18 +797,47 @@ void MainWindow::defaultApplicationOpen() {
     defaultOpen->show();
 }
 
+void MainWindow::editImplications() {
+    new ImplicationsWidget(database, tagWriter, this);
+}
+
+// Picks up where the last export left off.
+void MainWindow::exportChanges() {
+    QString filename = QFileDialog::getSaveFileName(this, "Export Changes", "changes.yaml", "YAML (*.yaml *.yml)");
+    if (!filename.isEmpty()) {
+        tagWriter->flush();
+        std::string last;
+        if (exportChangeLog(database, sql_get_meta_text(database, "exported"), filename.toStdString(), &last)) {
+            sql_set_meta_text(database, "exported", last);
+        }
+    }
+}
+
 void MainWindow::exportTags() {
     QFileDialog *fileDialog = new QFileDialog;
     QString filename = fileDialog->getSaveFileName(this, "Export Tags", "database.yaml", "YAML (*.yaml *.yml)");
     if (!filename.isEmpty()) {
+        tagWriter->flush();
         sql_write_database_contents(database, filename.toStdString());
     }
 }
 
+void MainWindow::importChanges() {
+    QString filename = QFileDialog::getOpenFileName(this, "Import Changes", "", "YAML (*.yaml *.yml)");
+    if (!filename.isEmpty()) {
+        tagWriter->flush();
+        int applied, skipped;
+        if (importChangeLog(database, filename.toStdString(), settings->scanDirs, &applied, &skipped)) {
+            buildEntries(searchBox->text());
+        }
+    }
+}
+
 void MainWindow::importTags() {
     QFileDialog *fileDialog = new QFileDialog;
     QString filename = fileDialog->getOpenFileName(this, "Import Tags", "", "YAML (*.yaml *.yml)");
     if (!filename.isEmpty()) {
+        tagWriter->flush();
         YAML::Node node = YAML::LoadFile(filename.toStdString().c_str());
         for (YAML::const_iterator it = node.begin(); it != node.end(); ++it) {
             QStringList filenames;
@@ -374,15 +870,24 @@ void MainWindow::importTags() {
     }
 }
 
+// Anything that changes the shown list in place needs a copy of its own
+// while the list is still read from the snapshot.
+void MainWindow::loadEntries() {
+    if (model->showsSnapshot()) {
+        entries = snapshot->paths();
+    }
+}
+
 void MainWindow::openFiles(bool defaultApplication) {
     QStringList filenames = getSelectedFiles(listView);
-    //TODO: use mime types somehow
-    std::string args = defaultApplication ? settings->defaultApplicationPath : openWithEntry->text().toStdString();
-    args += " ";
-    for (int i = 0; i < filenames.size(); ++i) {
-        args += "\"" + filenames.at(i).toStdString() + "\" ";
+    if (filenames.isEmpty()) {
+        return;
+    }
+    if (defaultApplication) {
+        launcher->openFiles(filenames);
+    } else {
+        launcher->openFilesWith(openWithEntry->text(), filenames);
     }
-    popen(args.c_str(), "r");
 }
 
 void MainWindow::openFilesWith() {
@@ -404,9 +909,17 @@ void MainWindow::openFilesWith() {
     openWith->show();
 }
 
+void MainWindow::refineFacet(QListWidgetItem *item) {
+    QString tag = item->data(Qt::UserRole).toString();
+    QString text = searchBox->text().trimmed();
+    searchBox->setText(text.isEmpty() ? tag : text + "," + tag);
+}
+
 void MainWindow::removeFiles() {
     QStringList filenames = getSelectedFiles(listView);
     if (!filenames.isEmpty()) {
+        loadEntries();
+        tagWriter->flush();
         if (sql_remove_paths(database, filenames)) {
             for (int i = 0; i < filenames.size(); ++i) {
                 entries.removeOne(filenames.at(i));
@@ -417,6 +930,146 @@ void MainWindow::removeFiles() {
     }
 }
 
+// A single statement can't be cut short, so a slice may well take longer
+// than planned. Only one runs at a time, and the next one is scheduled
+// once it is done. The snapshot file is rewritten here as well once
+// something was committed, so closing the window rarely has to. The
+// generation is taken before anything is read: a write that slips in
+// between leaves the file looking out of date, never the other way round.
+// The loaded snapshot stays as it is, searches may still be reading it.
+void MainWindow::runMaintenance() {
+    uint64_t generation = sql_get_generation();
+    if (!snapshotRunning && snapshotGeneration != generation) {
+        snapshotRunning = true;
+        pool->submit([this, generation] {
+            sqlite3 *connection = connectDatabase();
+            if (writeSnapshot(connection, getUserFile("snapshot"), generation)) {
+                snapshotGeneration = generation;
+            }
+            sqlite3_close(connection);
+            QMetaObject::invokeMethod(this, [this] { snapshotRunning = false; }, Qt::QueuedConnection);
+        });
+    }
+    if (maintenanceRunning) {
+        return;
+    }
+    maintenanceRunning = true;
+    pool->submit([this] {
+        bool more = maintenance->step(MAINTENANCE_SLICE);
+        QList<databaseStats> stats = maintenance->stats();
+        QMetaObject::invokeMethod(this, [this, more, stats] { showMaintenance(more, stats); }, Qt::QueuedConnection);
+    });
+}
+
+void MainWindow::showEntries() {
+    showEdits();
+    model->setStringList(entries);
+    trace_record_materialized(entries.size());
+    updatePerfOverlay();
+    facetTimer->start();
+}
+
+// Edits that are queued but not committed yet are shown as if they were:
+// the edited files that no longer match the search are dropped from the
+// list and those that now do are put in. Everything else, the query cache
+// and the snapshot included, only ever holds what is in the database, so
+// once the edits are committed (or given up on) the list is just built
+// again from there.
+void MainWindow::showEdits() {
+    QHash<QPair<QString, QString>, bool> edits = tagWriter->uncommitted();
+    QStringList tag_terms;
+    metadataQuery query = parseMetadataQuery(splitTags(searchBox->text().toStdString(), ','), &tag_terms);
+    // Tags only change which files match, not which ones there are.
+    if (edits.isEmpty() || tag_terms.isEmpty()) {
+        return;
+    }
+    bool exact_match = exactMatch->isChecked();
+    QSet<QString> matches = sql_match_edits(database, edits, tag_terms, exact_match);
+    PathMatcher matcher(tag_terms);
+    QSet<QString> edited;
+    QStringList added;
+    for (auto it = edits.begin(); it != edits.end(); ++it) {
+        const QString &path = it.key().first;
+        if (edited.contains(path)) {
+            continue;
+        }
+        edited.insert(path);
+        if (matches.contains(path) || (!exact_match && matcher.matches(path))) {
+            added.append(path);
+        }
+    }
+
+    QStringList kept;
+    for (int i = 0; i < entries.size(); ++i) {
+        if (!edited.contains(entries.at(i))) {
+            kept.append(entries.at(i));
+        }
+    }
+    // The metadata was loaded when the search was run.
+    metadataQuery filters = query;
+    filters.sort = FIELD_NONE;
+    if (!filters.filters.isEmpty()) {
+        metadata->apply(added, filters);
+    }
+    added.sort();
+    entries.clear();
+    entries.reserve(kept.size() + added.size());
+    std::merge(kept.begin(), kept.end(), added.begin(), added.end(), std::back_inserter(entries));
+    if (query.sort != FIELD_NONE) {
+        metadataQuery sort = query;
+        sort.filters.clear();
+        metadata->apply(entries, sort);
+    }
+}
+
+void MainWindow::showFacets(std::shared_ptr<FacetJob> job) {
+    if (job != facetJob) {
+        return;
+    }
+    facetJob.reset();
+    facetList->clear();
+    QStringList terms = splitTags(searchBox->text().toStdString(), ',');
+    const QList<QPair<int, QString>> facets = job->result();
+    int shown = 0;
+    for (int i = 0; i < facets.size() && shown < FACET_LIMIT; ++i) {
+        if (terms.contains(facets.at(i).second)) {
+            continue;
+        }
+        QListWidgetItem *item = new QListWidgetItem(QString("%1 (%2)").arg(facets.at(i).second).arg(facets.at(i).first));
+        item->setData(Qt::UserRole, facets.at(i).second);
+        facetList->addItem(item);
+        ++shown;
+    }
+}
+
+// The status bar is otherwise only there for the overlay, so it is shown
+// for as long as there is something to report.
+void MainWindow::showIdentityProgress(int done, int total) {
+    if (closing) {
+        return;
+    }
+    if (done < total) {
+        statusBar()->showMessage(QString("Identifying files: %1 of %2").arg(done).arg(total));
+    } else {
+        statusBar()->clearMessage();
+    }
+    statusBar()->setVisible(perfOverlay->isChecked() || done < total);
+}
+
+// Anything that happened in the meantime already pushed the next slice
+// back, so the timer is only started if it isn't running.
+void MainWindow::showMaintenance(bool more, QList<databaseStats> stats) {
+    if (closing) {
+        return;
+    }
+    maintenanceRunning = false;
+    maintenanceStats = stats;
+    if (!maintenanceTimer->isActive()) {
+        maintenanceTimer->start(more ? MAINTENANCE_SLICE_GAP : MAINTENANCE_INTERVAL);
+    }
+    updatePerfOverlay();
+}
+
 void MainWindow::tagFiles() {
     tagDialog = new QDialog(this);
     QLabel *tagLabel = new QLabel("Tags:", this);
@@ -436,6 +1089,51 @@ void MainWindow::tagFiles() {
     tagDialog->show();
 }
 
+void MainWindow::tagsCommitted(bool ok) {
+    if (closing) {
+        return;
+    }
+    if (!ok) {
+        QMessageBox::warning(this, "Tags", "Some tag edits couldn't be saved and were undone.");
+    }
+    maintenanceTimer->start(MAINTENANCE_IDLE_DELAY);
+    // Tags don't change the list of all files, only search results.
+    if (searchBox->text().isEmpty()) {
+        facetTimer->start();
+    } else {
+        buildEntries(searchBox->text());
+    }
+}
+
+// Starting it again while it runs does nothing.
+void MainWindow::toggleIdentity(bool checked) {
+    if (!checked) {
+        return;
+    }
+    identityBackfill->start([this](int done, int total) {
+        QMetaObject::invokeMethod(this, [this, done, total] { showIdentityProgress(done, total); },
+                                  Qt::QueuedConnection);
+    });
+}
+
+void MainWindow::togglePerfOverlay(bool checked) {
+    statusBar()->setVisible(checked || !statusBar()->currentMessage().isEmpty());
+    if (checked) {
+        updatePerfOverlay();
+    }
+}
+
+// SQLite only attaches so many databases to one connection, the scan
+// directories past that stay in the main one.
+void MainWindow::toggleShards(bool checked) {
+    int limit = sql_get_shard_limit(database);
+    if (checked && settings->scanDirs.size() > limit) {
+        QMessageBox::warning(this, "Separate Databases",
+                             QString("Only the first %1 scan directories can get a database of their own, "
+                                     "the others stay in the main one.").arg(limit));
+    }
+}
+
 void MainWindow::updateApplication(bool update) {
     if (update) {
         settings->defaultApplicationPath = defaultOpenWith->text().toStdString();
@@ -447,15 +1145,64 @@ void MainWindow::updateEntries(bool checked) {
     MainWindow::buildEntries(searchBox->text());
 }
 
+void MainWindow::updateFacets() {
+    TraceScope scope("updateFacets");
+    if (facetJob) {
+        facetJob->cancel();
+        facetJob.reset();
+    }
+    // An empty search shows (and counts) the whole library, even while the
+    // list is still read from the snapshot.
+    QStringList terms = splitTags(searchBox->text().toStdString(), ',');
+    bool all = model->showsSnapshot() || terms.isEmpty();
+    if (!all && entries.isEmpty()) {
+        facetList->clear();
+        return;
+    }
+
+    // Tags that are already part of the query would just match everything,
+    // so enough are counted to leave FACET_LIMIT once they are dropped.
+    bool snapshot_current = snapshot->isValid() && snapshot->generation() == sql_get_generation();
+    std::shared_ptr<FacetJob> job = std::make_shared<FacetJob>(all ? QStringList() : entries, all,
+                                                               FACET_LIMIT + terms.size(),
+                                                               snapshot_current ? snapshot : nullptr);
+    facetJob = job;
+    facetCounter->start(job, [this, job] {
+        QMetaObject::invokeMethod(this, [this, job] { showFacets(job); }, Qt::QueuedConnection);
+    });
+}
+
+void MainWindow::updatePerfOverlay() {
+    if (!perfOverlay->isChecked()) {
+        return;
+    }
+    traceStats stats = trace_get_stats();
+    int64_t pages = 0, free_pages = 0, size = 0;
+    for (int i = 0; i < maintenanceStats.size(); ++i) {
+        pages += maintenanceStats.at(i).pages;
+        free_pages += maintenanceStats.at(i).freePages;
+        size += maintenanceStats.at(i).pages * maintenanceStats.at(i).pageSize;
+    }
+    perfLabel->setText(QString("Query: %1 ms | Rows returned: %2 | Rows shown: %3 | Database: %4 MiB, %5% free")
+                       .arg(stats.queryTime / 1000000.0, 0, 'f', 2)
+                       .arg(stats.rowsReturned)
+                       .arg(stats.rowsMaterialized)
+                       .arg(size / 1048576.0, 0, 'f', 1)
+                       .arg(pages ? free_pages * 100 / pages : 0));
+}
+
 void MainWindow::updateTags(bool add) {
     QStringList filenames = getSelectedFiles(listView);
     QStringList tags = splitTags(tagEdit->text().toStdString(), ',');
 
+    // The writer commits in the background, so the dialog doesn't have to
+    // wait for the database. The list shows the edits right away (unless a
+    // search is still running, which shows them once it is done) and is
+    // built again once they are committed.
     if (!tags.isEmpty()) {
-        if (add) {
-            sql_add_tags(database, filenames, tags);
-        } else {
-            sql_remove_tags(database, filenames, tags);
+        tagWriter->enqueue(filenames, tags, add);
+        if (!model->showsSnapshot() && !filterJob) {
+            showEntries();
         }
     }
     tagDialog->close();
@@ -0,0 +1,250 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#include "maintenance.h"
+#include "sql.h"
+#include "trace.h"
+
+// How many changes make the change log worth trimming, how much of the
+// log is trimmed in one go, by what fraction (and at least how many
+// pages) a database has to grow or shrink for its planner statistics to
+// be worth refreshing, how many rows of each index are looked at for the
+// statistics and how many free pages are handed back in one go.
+#define TRIM_CHANGES 1000
+#define TRIM_STEP_CHANGES 1000
+#define ANALYZE_DRIFT 10
+#define ANALYZE_PAGES 16
+#define ANALYSIS_LIMIT 1000
+#define VACUUM_STEP_PAGES 128
+
+enum maintenanceStage {
+    STAGE_TRIM,
+    STAGE_ANALYZE,
+    STAGE_VACUUM,
+    STAGE_CHECKPOINT,
+    STAGE_OPTIMIZE,
+};
+
+static int64_t pragma_value(sqlite3 *database, const std::string &sql) {
+    int64_t value = -1;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            value = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return value;
+}
+
+// False if the database was busy (or anything else went wrong), in which
+// case the step is simply repeated later.
+static bool exec_step(sqlite3 *database, const std::string &sql) {
+    char *err;
+    int ret = sqlite3_exec(database, sql.c_str(), NULL, 0, &err);
+    if (ret != SQLITE_OK) {
+        if (ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
+            std::cerr << "Error while maintaining database: " << err << std::endl;
+        }
+        sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+
+Maintenance::Maintenance() : schema(0), stage(STAGE_TRIM), trimFrom(0), trimUntil(-1) {
+    database = connectDatabase();
+    sqlite3_busy_timeout(database, 0);
+    schemas = sql_get_schemas();
+}
+
+Maintenance::~Maintenance() {
+    sqlite3_close(database);
+}
+
+// Remembers how big the database was, to tell when the statistics have
+// gone stale.
+bool Maintenance::analyze(const QString &schema) {
+    std::string name = schema.toStdString();
+    if (!exec_step(database, "PRAGMA analysis_limit=" + std::to_string(ANALYSIS_LIMIT) + ";" + \
+                             "ANALYZE " + name)) {
+        return false;
+    }
+    sql_set_meta(database, ("analyzed_pages_" + name).c_str(), usedPages(schema));
+    return true;
+}
+
+bool Maintenance::checkpoint(const QString &schema, int mode) {
+    int ret = sqlite3_wal_checkpoint_v2(database, schema.toStdString().c_str(), mode, NULL, NULL);
+    return ret == SQLITE_OK;
+}
+
+// Not every write is in the change log (pruned files, metadata and
+// identities aren't), so this goes by how much the database has grown or
+// shrunk since it was last analyzed instead. A database that never was
+// (one made before statistics were kept, say) is analyzed right away.
+bool Maintenance::stale(const QString &schema) {
+    std::string name = schema.toStdString();
+    if (pragma_value(database, "SELECT COUNT(*) FROM " + name + ".sqlite_master WHERE name = 'sqlite_stat1'") == 0) {
+        return true;
+    }
+    int64_t analyzed = sql_get_meta(database, ("analyzed_pages_" + name).c_str());
+    int64_t drift = std::abs(usedPages(schema) - analyzed);
+    return drift >= ANALYZE_PAGES && drift * ANALYZE_DRIFT >= analyzed;
+}
+
+// Returns where to go on from, -1 once done, and the same position again
+// if the database was busy.
+int64_t Maintenance::trim(const QString &schema, int64_t from) {
+    return sql_trim_changes(database, schema, from, TRIM_STEP_CHANGES);
+}
+
+// Pages that hold something, which goes up and down with the rows.
+int64_t Maintenance::usedPages(const QString &schema) {
+    std::string prefix = "PRAGMA " + schema.toStdString() + ".";
+    return pragma_value(database, prefix + "page_count") - pragma_value(database, prefix + "freelist_count");
+}
+
+// Zero pages means all of them.
+bool Maintenance::vacuum(const QString &schema, int pages) {
+    std::string sql = "PRAGMA " + schema.toStdString() + ".incremental_vacuum";
+    if (pages > 0) {
+        sql += "(" + std::to_string(pages) + ")";
+    }
+    return exec_step(database, sql);
+}
+
+// Runs everything to the end without slicing, waiting for locks and
+// converting databases that can't be vacuumed incrementally yet, which
+// rewrites them once.
+void Maintenance::finish() {
+    TraceScope scope("Maintenance::finish");
+    sqlite3_busy_timeout(database, 5000);
+    int64_t last = sql_get_last_change(database);
+    for (int i = 0; i < schemas.size(); ++i) {
+        std::string schema = schemas.at(i).toStdString();
+        if (pragma_value(database, "PRAGMA " + schema + ".auto_vacuum") != 2) {
+            exec_step(database, "PRAGMA " + schema + ".auto_vacuum=INCREMENTAL;VACUUM " + schema);
+        }
+        for (int64_t from = 0, next; from >= 0; from = next) {
+            next = trim(schemas.at(i), from);
+            if (next == from) {
+                break;
+            }
+        }
+        analyze(schemas.at(i));
+        vacuum(schemas.at(i), 0);
+        checkpoint(schemas.at(i), SQLITE_CHECKPOINT_TRUNCATE);
+    }
+    sql_set_meta(database, "trimmed", last);
+    exec_step(database, "PRAGMA optimize");
+    sqlite3_busy_timeout(database, 0);
+    stage = STAGE_TRIM;
+    schema = 0;
+    trimUntil = -1;
+}
+
+QList<databaseStats> Maintenance::stats() {
+    QList<databaseStats> list;
+    for (int i = 0; i < schemas.size(); ++i) {
+        std::string prefix = "PRAGMA " + schemas.at(i).toStdString() + ".";
+        databaseStats stats;
+        stats.freePages = pragma_value(database, prefix + "freelist_count");
+        stats.incremental = pragma_value(database, prefix + "auto_vacuum") == 2;
+        stats.pageSize = pragma_value(database, prefix + "page_size");
+        stats.pages = pragma_value(database, prefix + "page_count");
+        stats.schema = schemas.at(i);
+        list.append(stats);
+    }
+    return list;
+}
+
+// Does at most about a budget's worth of work (in nanoseconds, a single
+// statement can't be cut short) and returns whether the round still has
+// more to do. The round after a finished one starts from the beginning.
+bool Maintenance::step(int64_t budget) {
+    TraceScope scope("Maintenance::step");
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(budget);
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (schema == schemas.size()) {
+            schema = 0;
+            ++stage;
+        }
+        std::string name = schema < schemas.size() ? schemas.at(schema).toStdString() : "";
+        switch (stage) {
+        case STAGE_TRIM: {
+            if (schema == 0 && trimUntil < 0) {
+                int64_t last = sql_get_last_change(database);
+                if (last - sql_get_meta(database, "trimmed") < TRIM_CHANGES) {
+                    schema = schemas.size();
+                    break;
+                }
+                trimFrom = 0;
+                trimUntil = last;
+            }
+            int64_t next = trim(schemas.at(schema), trimFrom);
+            if (next == trimFrom) {
+                return true;
+            }
+            trimFrom = next < 0 ? 0 : next;
+            if (next < 0 && ++schema == schemas.size()) {
+                sql_set_meta(database, "trimmed", trimUntil);
+                trimUntil = -1;
+            }
+            break;
+        }
+        case STAGE_ANALYZE:
+            if (stale(schemas.at(schema)) && !analyze(schemas.at(schema))) {
+                return true;
+            }
+            ++schema;
+            break;
+        case STAGE_VACUUM:
+            if (pragma_value(database, "PRAGMA " + name + ".auto_vacuum") != 2 ||
+                pragma_value(database, "PRAGMA " + name + ".freelist_count") <= 0) {
+                ++schema;
+            } else if (!vacuum(schemas.at(schema), VACUUM_STEP_PAGES)) {
+                return true;
+            }
+            break;
+        case STAGE_CHECKPOINT:
+            // Passive never waits for readers, so it may leave part of the
+            // log for next time.
+            checkpoint(schemas.at(schema), SQLITE_CHECKPOINT_PASSIVE);
+            ++schema;
+            break;
+        case STAGE_OPTIMIZE:
+            if (!exec_step(database, "PRAGMA optimize")) {
+                return true;
+            }
+            int64_t free_pages = 0;
+            QList<databaseStats> list = stats();
+            for (int i = 0; i < list.size(); ++i) {
+                free_pages += list.at(i).freePages;
+            }
+            trace_counter("free_pages", free_pages);
+            stage = STAGE_TRIM;
+            schema = 0;
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,213 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "match.h"
+
+// Kernels return 1 on a match, 0 if nothing matched and the string was
+// pure ASCII or -1 if nothing matched but there were non-ASCII characters
+// (so the caller has to fall back to full Unicode case folding).
+enum {
+    MATCH_NON_ASCII = -1,
+    MATCH_NONE = 0,
+    MATCH_FOUND = 1,
+};
+
+static inline char16_t fold_ascii(char16_t c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline bool equal_folded(const char16_t *str, const char16_t *needle, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (fold_ascii(str[i]) != needle[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks every position from start onwards without any vector loads.
+static int match_tail(const char16_t *str, size_t len, size_t start, bool non_ascii,
+                      const std::vector<std::u16string> &needles) {
+    for (size_t i = start; i < len; ++i) {
+        if (str[i] > 0x7F) {
+            non_ascii = true;
+        }
+        for (const std::u16string &needle : needles) {
+            if (i + needle.size() <= len && equal_folded(str + i, needle.data(), needle.size())) {
+                return MATCH_FOUND;
+            }
+        }
+    }
+    return non_ascii ? MATCH_NON_ASCII : MATCH_NONE;
+}
+
+static int match_scalar(const char16_t *str, size_t len, const std::vector<std::u16string> &needles, size_t max_len) {
+    return match_tail(str, len, 0, false, needles);
+}
+
+#ifdef HAVE_X86_SIMD
+// The vector kernels compare the first and last character of every needle
+// against a whole block of positions at once and only verify the middle of
+// the needle for candidate positions. Each needle is checked against the
+// same block so all of them are tested in a single pass over the string.
+// Lanes are 16 bits wide, so each lane sets two bits in the byte mask.
+
+static inline __m128i fold_sse2(__m128i v) {
+    // Shift 'A' down to the smallest signed value so that a single signed
+    // compare finds 'A'-'Z'.
+    __m128i shifted = _mm_add_epi16(v, _mm_set1_epi16(static_cast<short>(0x8000 - 'A')));
+    __m128i upper = _mm_cmplt_epi16(shifted, _mm_set1_epi16(static_cast<short>(-0x8000 + 26)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi16(0x20)));
+}
+
+static int match_sse2(const char16_t *str, size_t len, const std::vector<std::u16string> &needles, size_t max_len) {
+    const size_t width = 8;
+    const __m128i high_bits = _mm_set1_epi16(static_cast<short>(0xFF80));
+    __m128i non_ascii = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + max_len - 1 + width <= len; i += width) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + i));
+        non_ascii = _mm_or_si128(non_ascii, _mm_and_si128(block, high_bits));
+        __m128i first_block = fold_sse2(block);
+        for (const std::u16string &needle : needles) {
+            size_t k = needle.size();
+            __m128i last_block = fold_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(str + i + k - 1)));
+            __m128i eq = _mm_and_si128(_mm_cmpeq_epi16(first_block, _mm_set1_epi16(needle[0])),
+                                       _mm_cmpeq_epi16(last_block, _mm_set1_epi16(needle[k - 1])));
+            unsigned mask = _mm_movemask_epi8(eq);
+            while (mask) {
+                unsigned bit = __builtin_ctz(mask);
+                if (k <= 2 || equal_folded(str + i + bit / 2 + 1, needle.data() + 1, k - 2)) {
+                    return MATCH_FOUND;
+                }
+                mask &= ~(3u << bit);
+            }
+        }
+    }
+    bool seen = _mm_movemask_epi8(_mm_cmpeq_epi16(non_ascii, _mm_setzero_si128())) != 0xFFFF;
+    return match_tail(str, len, i, seen, needles);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i v) {
+    __m256i shifted = _mm256_add_epi16(v, _mm256_set1_epi16(static_cast<short>(0x8000 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi16(_mm256_set1_epi16(static_cast<short>(-0x8000 + 26)), shifted);
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi16(0x20)));
+}
+
+__attribute__((target("avx2")))
+static int match_avx2(const char16_t *str, size_t len, const std::vector<std::u16string> &needles, size_t max_len) {
+    const size_t width = 16;
+    const __m256i high_bits = _mm256_set1_epi16(static_cast<short>(0xFF80));
+    __m256i non_ascii = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + max_len - 1 + width <= len; i += width) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + i));
+        non_ascii = _mm256_or_si256(non_ascii, _mm256_and_si256(block, high_bits));
+        __m256i first_block = fold_avx2(block);
+        for (const std::u16string &needle : needles) {
+            size_t k = needle.size();
+            __m256i last_block = fold_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + i + k - 1)));
+            __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi16(first_block, _mm256_set1_epi16(needle[0])),
+                                          _mm256_cmpeq_epi16(last_block, _mm256_set1_epi16(needle[k - 1])));
+            unsigned mask = _mm256_movemask_epi8(eq);
+            while (mask) {
+                unsigned bit = __builtin_ctz(mask);
+                if (k <= 2 || equal_folded(str + i + bit / 2 + 1, needle.data() + 1, k - 2)) {
+                    return MATCH_FOUND;
+                }
+                mask &= ~(3u << bit);
+            }
+        }
+    }
+    bool seen = !_mm256_testz_si256(non_ascii, non_ascii);
+    return match_tail(str, len, i, seen, needles);
+}
+#endif
+
+static matchKernel select_kernel() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return match_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return match_sse2;
+    }
+#endif
+    return match_scalar;
+}
+
+PathMatcher::PathMatcher(const QStringList &terms) {
+    static const matchKernel best_kernel = select_kernel();
+    kernel = best_kernel;
+    matchEverything = false;
+    maxLength = 0;
+    for (int i = 0; i < terms.size(); ++i) {
+        QString term = terms.at(i).toLower();
+        if (term.isEmpty()) {
+            // Every string contains the empty string.
+            matchEverything = true;
+            continue;
+        }
+        const char16_t *data = reinterpret_cast<const char16_t *>(term.utf16());
+        std::u16string needle(data, term.size());
+        bool ascii = std::all_of(needle.begin(), needle.end(), [](char16_t c) { return c <= 0x7F; });
+        // A non-ASCII needle can never be found in a pure ASCII path.
+        if (ascii) {
+            maxLength = std::max(maxLength, needle.size());
+            asciiNeedles.push_back(needle);
+        } else {
+            unicodeNeedles.append(term);
+        }
+    }
+}
+
+bool PathMatcher::isEmpty() const {
+    return !matchEverything && asciiNeedles.empty() && unicodeNeedles.isEmpty();
+}
+
+bool PathMatcher::matches(const QString &path) const {
+    if (matchEverything) {
+        return true;
+    }
+    const char16_t *data = reinterpret_cast<const char16_t *>(path.utf16());
+    int ret = kernel(data, path.size(), asciiNeedles, maxLength);
+    if (ret != MATCH_NON_ASCII) {
+        return ret == MATCH_FOUND;
+    }
+
+    QString lower = path.toLower();
+    for (int i = 0; i < unicodeNeedles.size(); ++i) {
+        if (lower.contains(unicodeNeedles.at(i))) {
+            return true;
+        }
+    }
+    for (const std::u16string &needle : asciiNeedles) {
+        QString term = QString::fromUtf16(needle.data(), needle.size());
+        if (lower.contains(term)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,301 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <QDate>
+#include <QDateTime>
+#include <QHash>
+#include <QMimeDatabase>
+#include <QRegularExpression>
+#include <sys/stat.h>
+
+#include "metadata.h"
+#include "trace.h"
+
+static metadataField field_by_name(const QString &name) {
+    if (name == "mtime") {
+        return FIELD_MTIME;
+    } else if (name == "path") {
+        return FIELD_PATH;
+    } else if (name == "size") {
+        return FIELD_SIZE;
+    } else if (name == "type") {
+        return FIELD_TYPE;
+    }
+    return FIELD_NONE;
+}
+
+// Sizes take an optional binary K, M, G or T suffix.
+static bool parse_size(QString value, int64_t *size) {
+    int64_t multiplier = 1;
+    int unit = value.isEmpty() ? -1 : QString("KMGT").indexOf(value.back().toUpper());
+    if (unit >= 0) {
+        multiplier = static_cast<int64_t>(1) << (10 * (unit + 1));
+        value.chop(1);
+    }
+    bool ok;
+    double number = value.toDouble(&ok);
+    if (!ok || number < 0) {
+        return false;
+    }
+    *size = number * multiplier;
+    return true;
+}
+
+// Dates are YYYY-MM-DD and stand for the start of that day.
+static bool parse_time(const QString &value, int64_t *time) {
+    QDate date = QDate::fromString(value, Qt::ISODate);
+    if (!date.isValid()) {
+        return false;
+    }
+    *time = date.startOfDay().toSecsSinceEpoch();
+    return true;
+}
+
+static bool compare_value(int64_t value, const metadataFilter &filter) {
+    switch (filter.op) {
+    case OP_EQUAL:
+        return value == filter.value;
+    case OP_GREATER:
+        return value > filter.value;
+    case OP_GREATER_EQUAL:
+        return value >= filter.value;
+    case OP_LESS:
+        return value < filter.value;
+    case OP_LESS_EQUAL:
+        return value <= filter.value;
+    }
+    return false;
+}
+
+MetadataColumns::MetadataColumns() : loaded(false), loadedGeneration(0) {
+}
+
+void MetadataColumns::apply(QStringList &entries, const metadataQuery &query) const {
+    TraceScope scope("MetadataColumns::apply");
+    if (query.filters.isEmpty() && query.sort == FIELD_NONE) {
+        return;
+    }
+
+    // Entries are usually a sorted subset of the paths, in which case every
+    // lookup can start where the last one ended.
+    bool sorted = std::is_sorted(entries.begin(), entries.end());
+    std::vector<int> rows(entries.size());
+    int start = 0;
+    for (int i = 0; i < entries.size(); ++i) {
+        auto it = std::lower_bound(paths.begin() + (sorted ? start : 0), paths.end(), entries.at(i));
+        start = it - paths.begin();
+        rows[i] = it != paths.end() && *it == entries.at(i) ? start : -1;
+    }
+
+    std::vector<int> keep;
+    keep.reserve(entries.size());
+    for (int i = 0; i < entries.size(); ++i) {
+        bool match = query.filters.isEmpty() || rows[i] >= 0;
+        for (int j = 0; j < query.filters.size() && match; ++j) {
+            const metadataFilter &filter = query.filters.at(j);
+            bool result;
+            if (filter.field == FIELD_TYPE) {
+                result = typeNames.at(types[rows[i]]) == filter.type;
+            } else if (filter.field == FIELD_MTIME) {
+                result = compare_value(mtimes[rows[i]], filter);
+            } else {
+                result = compare_value(sizes[rows[i]], filter);
+            }
+            match = result != filter.negate;
+        }
+        if (match) {
+            keep.push_back(i);
+        }
+    }
+
+    if (query.sort != FIELD_NONE) {
+        std::vector<int> type_order(typeNames.size());
+        for (int i = 0; i < typeNames.size(); ++i) {
+            type_order[i] = std::count_if(typeNames.begin(), typeNames.end(),
+                                          [&](const QString &name) { return name < typeNames.at(i); });
+        }
+        auto key = [&](int row) -> int64_t {
+            if (query.sort == FIELD_MTIME) {
+                return mtimes[row];
+            } else if (query.sort == FIELD_SIZE) {
+                return sizes[row];
+            }
+            return type_order[types[row]];
+        };
+        // Anything without metadata goes last either way.
+        std::stable_sort(keep.begin(), keep.end(), [&](int a, int b) {
+            if (query.sort == FIELD_PATH) {
+                return query.descending ? entries.at(b) < entries.at(a) : entries.at(a) < entries.at(b);
+            }
+            if (rows[a] < 0 || rows[b] < 0) {
+                return rows[a] >= 0 && rows[b] < 0;
+            }
+            return query.descending ? key(rows[b]) < key(rows[a]) : key(rows[a]) < key(rows[b]);
+        });
+    }
+
+    QStringList result;
+    result.reserve(keep.size());
+    for (int i : keep) {
+        result.append(entries.at(i));
+    }
+    entries.swap(result);
+}
+
+bool MetadataColumns::isCurrent(uint64_t generation) const {
+    return loaded && loadedGeneration == generation;
+}
+
+void MetadataColumns::load(sqlite3 *database, uint64_t generation) {
+    TraceScope scope("MetadataColumns::load");
+    struct metadataRow {
+        QString path;
+        int64_t size;
+        int64_t mtime;
+        uint16_t type;
+    };
+    std::vector<metadataRow> rows;
+    QHash<QString, uint16_t> type_ids;
+    typeNames.clear();
+
+    sqlite3_stmt *stmt;
+    std::string sql = std::string("SELECT path, size, mtime, type FROM metadata");
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            QString type = (const char *)sqlite3_column_text(stmt, 3);
+            auto it = type_ids.find(type);
+            if (it == type_ids.end()) {
+                it = type_ids.insert(type, typeNames.size());
+                typeNames.append(type);
+            }
+            rows.push_back({(const char *)sqlite3_column_text(stmt, 0), sqlite3_column_int64(stmt, 1),
+                            sqlite3_column_int64(stmt, 2), it.value()});
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        std::cerr << "Error while reading metadata: " << sqlite3_errmsg(database) << std::endl;
+    }
+
+    // Sorted here rather than by sqlite so the order is the same as the
+    // (QString sorted) entries.
+    std::sort(rows.begin(), rows.end(), [](const metadataRow &a, const metadataRow &b) { return a.path < b.path; });
+    paths.clear();
+    paths.reserve(rows.size());
+    sizes.resize(rows.size());
+    mtimes.resize(rows.size());
+    types.resize(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        paths.append(rows[i].path);
+        sizes[i] = rows[i].size;
+        mtimes[i] = rows[i].mtime;
+        types[i] = rows[i].type;
+    }
+    loaded = true;
+    loadedGeneration = generation;
+    trace_counter("metadata_rows", rows.size());
+}
+
+bool isMetadataTerm(const QString &term) {
+    QStringList tags;
+    parseMetadataQuery(QStringList(term), &tags);
+    return tags.isEmpty();
+}
+
+metadataQuery parseMetadataQuery(const QStringList &terms, QStringList *tags) {
+    static const QRegularExpression range("^(size|mtime)(<=|>=|<|>|=)(.+)$");
+    metadataQuery query;
+    query.descending = false;
+    query.sort = FIELD_NONE;
+    for (int i = 0; i < terms.size(); ++i) {
+        const QString &term = terms.at(i);
+        if (term.startsWith("sort:")) {
+            QString name = term.mid(5);
+            bool descending = name.startsWith('-');
+            metadataField field = field_by_name(descending ? name.mid(1) : name);
+            if (field != FIELD_NONE) {
+                query.descending = descending;
+                query.sort = field;
+                continue;
+            }
+        }
+
+        metadataFilter filter;
+        filter.negate = term.startsWith('-');
+        QString body = filter.negate ? term.mid(1) : term;
+        if (body.startsWith("type:") && body.size() > 5) {
+            filter.field = FIELD_TYPE;
+            filter.op = OP_EQUAL;
+            filter.type = body.mid(5).toLower();
+            filter.value = 0;
+            query.filters.append(filter);
+            continue;
+        }
+        QRegularExpressionMatch match = range.match(body);
+        if (match.hasMatch()) {
+            filter.field = field_by_name(match.captured(1));
+            QString op = match.captured(2);
+            filter.op = op == "<=" ? OP_LESS_EQUAL : op == ">=" ? OP_GREATER_EQUAL :
+                        op == "<" ? OP_LESS : op == ">" ? OP_GREATER : OP_EQUAL;
+            bool ok = filter.field == FIELD_SIZE ? parse_size(match.captured(3), &filter.value) :
+                                                   parse_time(match.captured(3), &filter.value);
+            if (ok) {
+                query.filters.append(filter);
+                continue;
+            }
+        }
+        tags->append(term);
+    }
+    return query;
+}
+
+bool readMetadata(const QString &path, fileMetadata *metadata) {
+    struct stat st;
+    if (stat(path.toStdString().c_str(), &st) < 0) {
+        return false;
+    }
+    metadata->size = st.st_size;
+    metadata->mtime = st.st_mtim.tv_sec;
+    metadata->type = typeClass(path);
+    return true;
+}
+
+// Scans see the same few suffixes over and over, so the guess is cached
+// per suffix.
+QString typeClass(const QString &path) {
+    static QMimeDatabase mimeDatabase;
+    static QHash<QString, QString> typeCache;
+    static std::mutex mutex;
+
+    int slash = path.lastIndexOf('/');
+    int dot = path.lastIndexOf('.');
+    QString suffix = dot > slash + 1 ? path.mid(dot + 1).toLower() : QString();
+    if (!suffix.isEmpty()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = typeCache.find(suffix);
+        if (it != typeCache.end()) {
+            return it.value();
+        }
+    }
+    QString type = mimeDatabase.mimeTypeForFile(path, QMimeDatabase::MatchExtension).name().section('/', 0, 0);
+    if (!suffix.isEmpty()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        typeCache.insert(suffix, type);
+    }
+    return type;
+}
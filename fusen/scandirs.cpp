@@ -16,15 +16,35 @@
 
 #include <QFileDialog>
 #include <QGridLayout>
+#include <QLabel>
+#include <QMessageBox>
 #include <QPushButton>
 
 #include "scandirs.h"
 #include "sql.h"
 #include "utils.h"
 
-ScanDirsWidget::ScanDirsWidget(sqlite3 *dbase, mainSettings *set, QWidget *parent) : QWidget(parent) {
+// Newly added directories start out skipping the usual clutter.
+static const char *DEFAULT_EXCLUDES[] = {
+    ".cache/", ".git/", ".hg/", ".svn/", ".thumbnails/", "node_modules/", "*.part", "*.tmp", "*~",
+};
+
+static QStringList split_patterns(const QString &text) {
+    QStringList patterns;
+    QStringList split = text.split(',');
+    for (int i = 0; i < split.size(); ++i) {
+        QString pattern = split.at(i).trimmed();
+        if (!pattern.isEmpty()) {
+            patterns.append(pattern);
+        }
+    }
+    return patterns;
+}
+
+ScanDirsWidget::ScanDirsWidget(sqlite3 *dbase, mainSettings *set, TagWriter *writer, QWidget *parent) : QWidget(parent) {
     database = dbase;
     settings = set;
+    tagWriter = writer;
 
     scanDialog = new QDialog(this);
     scanList = new QListWidget(this);
@@ -33,18 +53,33 @@ ScanDirsWidget::ScanDirsWidget(sqlite3 *dbase, mainSettings *set, QWidget *paren
         new QListWidgetItem(tr(settings->scanDirs.at(i).toStdString().c_str()), scanList);
     }
 
+    QLabel *excludeLabel = new QLabel("Exclude:", this);
+    excludeEdit = new QLineEdit(this);
+    excludeEdit->setPlaceholderText(tr(".git/, *.tmp"));
+    QLabel *includeLabel = new QLabel("Include:", this);
+    includeEdit = new QLineEdit(this);
+    includeEdit->setPlaceholderText(tr("Everything"));
+    connect(scanList, &QListWidget::currentItemChanged, this, &ScanDirsWidget::showRules);
+
     QPushButton *addDirectory = new QPushButton("Add Directory", this);
     QPushButton *removeDirectory = new QPushButton("Remove Directory", this);
+    QPushButton *saveRules = new QPushButton("Save Rules", this);
     QPushButton *cancel = new QPushButton("Cancel", this);
     connect(addDirectory, &QPushButton::released, this, &ScanDirsWidget::addDirectory);
     connect(removeDirectory, &QPushButton::released, this, &ScanDirsWidget::removeDirectory);
+    connect(saveRules, &QPushButton::released, this, &ScanDirsWidget::saveRules);
     connect(cancel, &QPushButton::released, this, &ScanDirsWidget::cancel);
 
     QGridLayout *layout = new QGridLayout();
-    layout->addWidget(scanList, 0, 0, 0, 3);
-    layout->addWidget(addDirectory, 1, 0);
-    layout->addWidget(removeDirectory, 1, 1);
-    layout->addWidget(cancel, 1, 2);
+    layout->addWidget(scanList, 0, 0, 1, 4);
+    layout->addWidget(excludeLabel, 1, 0);
+    layout->addWidget(excludeEdit, 1, 1, 1, 3);
+    layout->addWidget(includeLabel, 2, 0);
+    layout->addWidget(includeEdit, 2, 1, 1, 3);
+    layout->addWidget(addDirectory, 3, 0);
+    layout->addWidget(removeDirectory, 3, 1);
+    layout->addWidget(saveRules, 3, 2);
+    layout->addWidget(cancel, 3, 3);
     scanDialog->setLayout(layout);
 
     scanDialog->setWindowTitle("Scan Directories");
@@ -55,11 +90,17 @@ void ScanDirsWidget::addDirectory() {
     QSet<QString> existing_files = sql_get_paths(database);
     QString directory = QFileDialog::getExistingDirectory(this, "Add Directory");
     if (!directory.isEmpty()) {
-        new QListWidgetItem(tr(directory.toStdString().c_str()), scanList);
+        scanRules rules;
+        for (const char *pattern : DEFAULT_EXCLUDES) {
+            rules.exclude.append(pattern);
+        }
+        settings->scanDirRules.insert(directory, rules);
         settings->scanDirs.append(directory);
+        scanList->setCurrentItem(new QListWidgetItem(tr(directory.toStdString().c_str()), scanList));
         // Technically doesn't update the whole list but as soon as a user searches
         // something, the entries will be refreshed anyways so don't worry about it.
-        scanDirectories(database, directory, existing_files);
+        tagWriter->flush();
+        scanDirectories(database, directory, existing_files, nullptr, rules);
     }
 }
 
@@ -71,4 +112,57 @@ void ScanDirsWidget::removeDirectory() {
     QString itemText = scanList->currentItem()->text();
     qDeleteAll(scanList->selectedItems());
     settings->scanDirs.removeOne(itemText);
+    settings->scanDirRules.remove(itemText);
+}
+
+void ScanDirsWidget::saveRules() {
+    QListWidgetItem *item = scanList->currentItem();
+    if (!item) {
+        return;
+    }
+    QString directory = item->text();
+    scanRules rules;
+    rules.exclude = split_patterns(excludeEdit->text());
+    rules.include = split_patterns(includeEdit->text());
+    settings->scanDirRules.insert(directory, rules);
+
+    // Drop whatever the new rules exclude and pick up what they now let in.
+    // Untagged files cost nothing to find again, but tags would be gone for
+    // good, so tagged files are only dropped if the user agrees.
+    tagWriter->flush();
+    QSet<QString> existing_files = sql_get_paths(database);
+    ScanFilter filter(rules);
+    QStringList excluded = getExcludedFiles(directory, existing_files, &filter);
+    QSet<QString> tagged_paths = sql_get_tagged_paths(database);
+    QStringList tagged;
+    QStringList untagged;
+    for (int i = 0; i < excluded.size(); ++i) {
+        if (tagged_paths.contains(excluded.at(i))) {
+            tagged.append(excluded.at(i));
+        } else {
+            untagged.append(excluded.at(i));
+        }
+    }
+    if (!tagged.isEmpty()) {
+        tagged.sort();
+        QMessageBox confirm(QMessageBox::Warning, "Remove Tagged Files",
+                            QString("The new rules exclude %1 files that have tags. Remove them and their tags "
+                                    "from the database? Otherwise they are kept.").arg(tagged.size()),
+                            QMessageBox::Yes | QMessageBox::No, this);
+        confirm.setDefaultButton(QMessageBox::No);
+        confirm.setDetailedText(tagged.join("\n"));
+        if (confirm.exec() == QMessageBox::Yes) {
+            untagged += tagged;
+        }
+    }
+    if (!untagged.isEmpty()) {
+        sql_forget_paths(database, untagged);
+    }
+    scanDirectories(database, directory, existing_files, nullptr, rules);
+}
+
+void ScanDirsWidget::showRules(QListWidgetItem *item) {
+    scanRules rules = item ? settings->scanDirRules.value(item->text()) : scanRules();
+    excludeEdit->setText(rules.exclude.join(", "));
+    includeEdit->setText(rules.include.join(", "));
 }
@@ -0,0 +1,275 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "scanfilter.h"
+
+enum globTokenKind {
+    TOKEN_ANY,
+    TOKEN_CLASS,
+    // "**/", any number of whole directories (including none).
+    TOKEN_DIRS,
+    // End of a pattern, carrying its flags.
+    TOKEN_END,
+    // "**", anything including slashes.
+    TOKEN_GLOBSTAR,
+    TOKEN_LITERAL,
+    TOKEN_STAR,
+};
+
+// Unusual pattern sets could need a lot of DFA states. Past this many the
+// cached states are thrown away and built again as they are needed.
+#define GLOB_MAX_STATES 1024
+
+#define MATCH_EXCLUDE 1
+#define MATCH_EXCLUDE_DIR 2
+#define MATCH_INCLUDE 4
+
+GlobAutomaton::GlobAutomaton() {
+    flush();
+}
+
+void GlobAutomaton::add(const std::string &pattern, uint8_t flags) {
+    starts.push_back(tokens.size());
+    size_t i = 0;
+    while (i < pattern.size()) {
+        globToken token;
+        token.kind = TOKEN_LITERAL;
+        token.literal = pattern[i];
+        token.flags = 0;
+        size_t end = std::string::npos;
+        if (pattern[i] == '[') {
+            // A ']' right after the opening (or the negation) is literal.
+            size_t first = i + 1;
+            if (first < pattern.size() && (pattern[first] == '!' || pattern[first] == '^')) {
+                ++first;
+            }
+            end = pattern.find(']', first + 1);
+            if (end != std::string::npos) {
+                for (size_t j = first; j < end; ++j) {
+                    if (j + 2 < end && pattern[j + 1] == '-') {
+                        for (int c = (uint8_t)pattern[j]; c <= (uint8_t)pattern[j + 2]; ++c) {
+                            token.set.set(c);
+                        }
+                        j += 2;
+                    } else {
+                        token.set.set((uint8_t)pattern[j]);
+                    }
+                }
+                if (first != i + 1) {
+                    token.set.flip();
+                }
+            }
+        }
+
+        if (pattern.compare(i, 3, "**/") == 0 && (i == 0 || pattern[i - 1] == '/')) {
+            token.kind = TOKEN_DIRS;
+            i += 3;
+        } else if (pattern.compare(i, 2, "**") == 0) {
+            token.kind = TOKEN_GLOBSTAR;
+            i += 2;
+        } else if (pattern[i] == '*') {
+            token.kind = TOKEN_STAR;
+            ++i;
+        } else if (pattern[i] == '?') {
+            token.kind = TOKEN_ANY;
+            ++i;
+        } else if (end != std::string::npos) {
+            token.kind = TOKEN_CLASS;
+            i = end + 1;
+        } else if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+            token.literal = pattern[i + 1];
+            i += 2;
+        } else {
+            ++i;
+        }
+        tokens.push_back(token);
+    }
+
+    globToken token;
+    token.kind = TOKEN_END;
+    token.literal = 0;
+    token.flags = flags;
+    tokens.push_back(token);
+    flush();
+}
+
+int GlobAutomaton::addState(std::vector<uint32_t> &positions) {
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+    auto it = stateIds.find(positions);
+    if (it != stateIds.end()) {
+        return it->second;
+    }
+    int id = states.size();
+    uint8_t flags = 0;
+    for (uint32_t position : positions) {
+        if (tokens[position].kind == TOKEN_END) {
+            flags |= tokens[position].flags;
+        }
+    }
+    std::array<int32_t, 256> row;
+    row.fill(-1);
+    stateIds.emplace(positions, id);
+    stateFlags.push_back(flags);
+    states.push_back(positions);
+    transitions.push_back(row);
+    return id;
+}
+
+// Stars can match nothing, so being at one also means being past it.
+void GlobAutomaton::enter(std::vector<uint32_t> &positions, uint32_t position) const {
+    positions.push_back(position);
+    uint8_t kind = tokens[position].kind;
+    if (kind == TOKEN_DIRS || kind == TOKEN_GLOBSTAR || kind == TOKEN_STAR) {
+        enter(positions, position + 1);
+    }
+}
+
+void GlobAutomaton::flush() {
+    stateIds.clear();
+    stateFlags.clear();
+    states.clear();
+    transitions.clear();
+    // The start state is always state 0.
+    std::vector<uint32_t> positions;
+    for (uint32_t start : starts) {
+        enter(positions, start);
+    }
+    addState(positions);
+}
+
+uint8_t GlobAutomaton::match(const std::string &text) {
+    int state = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        state = step(state, text[i]);
+        if (states[state].empty()) {
+            return 0;
+        }
+    }
+    return stateFlags[state];
+}
+
+int GlobAutomaton::step(int state, uint8_t c) {
+    int32_t next = transitions[state][c];
+    if (next >= 0) {
+        return next;
+    }
+
+    std::vector<uint32_t> positions;
+    for (uint32_t position : states[state]) {
+        const globToken &token = tokens[position];
+        switch (token.kind) {
+        case TOKEN_ANY:
+            if (c != '/') {
+                enter(positions, position + 1);
+            }
+            break;
+        case TOKEN_CLASS:
+            if (c != '/' && token.set[c]) {
+                enter(positions, position + 1);
+            }
+            break;
+        case TOKEN_DIRS:
+            // Only a slash can finish a directory.
+            positions.push_back(position);
+            if (c == '/') {
+                enter(positions, position + 1);
+            }
+            break;
+        case TOKEN_GLOBSTAR:
+            enter(positions, position);
+            break;
+        case TOKEN_LITERAL:
+            if (c == token.literal) {
+                enter(positions, position + 1);
+            }
+            break;
+        case TOKEN_STAR:
+            if (c != '/') {
+                enter(positions, position);
+            }
+            break;
+        }
+    }
+
+    bool flushed = false;
+    if (states.size() >= GLOB_MAX_STATES) {
+        flush();
+        flushed = true;
+    }
+    next = addState(positions);
+    if (!flushed) {
+        transitions[state][c] = next;
+    }
+    return next;
+}
+
+static void add_pattern(GlobAutomaton &names, GlobAutomaton &paths, std::string pattern, bool include) {
+    bool directory = pattern.size() > 1 && pattern.back() == '/';
+    if (directory) {
+        pattern.pop_back();
+    }
+    bool anchored = !pattern.empty() && pattern[0] == '/';
+    if (anchored) {
+        pattern.erase(0, 1);
+    }
+    if (pattern.empty()) {
+        return;
+    }
+    bool path = anchored || pattern.find('/') != std::string::npos;
+    if (include && directory) {
+        // Including a directory includes everything below it.
+        pattern = (path ? pattern : "**/" + pattern) + "/**";
+        path = true;
+    }
+    uint8_t flags = include ? MATCH_INCLUDE : directory ? MATCH_EXCLUDE_DIR : MATCH_EXCLUDE;
+    (path ? paths : names).add(pattern, flags);
+}
+
+ScanFilter::ScanFilter(const scanRules &rules) {
+    empty = rules.exclude.isEmpty() && rules.include.isEmpty();
+    hasIncludes = !rules.include.isEmpty();
+    for (int i = 0; i < rules.exclude.size(); ++i) {
+        add_pattern(names, paths, rules.exclude.at(i).toStdString(), false);
+    }
+    for (int i = 0; i < rules.include.size(); ++i) {
+        add_pattern(names, paths, rules.include.at(i).toStdString(), true);
+    }
+}
+
+bool ScanFilter::excludesDirectory(const std::string &name, const std::string &relative) {
+    if (empty) {
+        return false;
+    }
+    return (names.match(name) | paths.match(relative)) & (MATCH_EXCLUDE | MATCH_EXCLUDE_DIR);
+}
+
+bool ScanFilter::includesFile(const std::string &name, const std::string &relative) {
+    if (empty) {
+        return true;
+    }
+    uint8_t flags = names.match(name) | paths.match(relative);
+    if (flags & MATCH_EXCLUDE) {
+        return false;
+    }
+    return !hasIncludes || (flags & MATCH_INCLUDE);
+}
+
+bool ScanFilter::isEmpty() const {
+    return empty;
+}
@@ -0,0 +1,116 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include "shards.h"
+#include "sql.h"
+#include "trace.h"
+#include "utils.h"
+
+static sqlite3 *open_readonly(const std::string &file) {
+    sqlite3 *connection;
+    int ret = sqlite3_open_v2(file.c_str(), &connection, SQLITE_OPEN_READONLY, NULL);
+    if (ret != SQLITE_OK) {
+        std::cerr << "Error while trying to open database: " << sqlite3_errstr(ret) << std::endl;
+        sqlite3_close(connection);
+        return NULL;
+    }
+    sqlite3_busy_timeout(connection, 5000);
+    return connection;
+}
+
+// What the tasks of one query share. Whichever finishes last hands the
+// result over.
+struct shardQuery {
+    std::mutex mutex;
+    size_t remaining;
+    QSet<QString> entries;
+    std::function<void(QSet<QString>)> finished;
+};
+
+ShardSet::ShardSet(sqlite3 *database, ThreadPool *pool) : database(database), pool(pool) {
+    std::string main_file = getUserFile("data").string();
+    sqlite3 *connection = open_readonly(main_file);
+    if (!connection) {
+        return;
+    }
+    connections.push_back(connection);
+    QStringList files = sql_get_shard_files();
+    for (int i = 0; i < files.size(); ++i) {
+        connection = open_readonly(files.at(i).toStdString());
+        if (!connection) {
+            continue;
+        }
+        // The shard has no closure table of its own, so it is found here.
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(connection, "ATTACH DATABASE ?1 AS global", -1, &stmt, NULL) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, main_file.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        }
+        connections.push_back(connection);
+    }
+}
+
+ShardSet::~ShardSet() {
+    for (sqlite3 *connection : connections) {
+        sqlite3_close(connection);
+    }
+}
+
+// Doesn't wait for the result, finished is called on the pool once every
+// database answered. A query that was cancelled in the meantime skips the
+// databases it didn't get to yet and hands nothing over. Queries may
+// overlap, SQLite lets them take turns on a connection.
+void ShardSet::start(const QStringList &tags, bool exact, const std::atomic<bool> *cancelled,
+                     std::function<void(QSet<QString>)> finished) {
+    // Only if the main database couldn't be opened a second time.
+    if (connections.empty()) {
+        pool->submit([this, tags, exact, cancelled, finished] {
+            QSet<QString> entries = sql_update_entries(database, tags, exact);
+            if (!cancelled->load()) {
+                finished(entries);
+            }
+        });
+        return;
+    }
+
+    std::shared_ptr<shardQuery> query = std::make_shared<shardQuery>();
+    query->remaining = connections.size();
+    query->finished = finished;
+    for (size_t i = 0; i < connections.size(); ++i) {
+        pool->submit([this, i, tags, exact, cancelled, query] {
+            QSet<QString> entries;
+            if (!cancelled->load()) {
+                TraceScope scope("ShardSet::start");
+                entries = sql_update_entries(connections[i], tags, exact);
+            }
+            std::unique_lock<std::mutex> lock(query->mutex);
+            query->entries.unite(entries);
+            if (--query->remaining > 0) {
+                return;
+            }
+            lock.unlock();
+            if (!cancelled->load()) {
+                query->finished(query->entries);
+            }
+        });
+    }
+}
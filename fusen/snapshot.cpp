@@ -0,0 +1,440 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <QHash>
+#include <QSet>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <xxhash.h>
+
+#include "snapshot.h"
+#include "trace.h"
+
+#define SNAPSHOT_MAGIC "FUSENIDX"
+#define SNAPSHOT_VERSION 3
+
+// All offsets are from the start of the file. The offset tables hold
+// count + 1 entries so the length of entry i is table[i + 1] - table[i].
+// One checksum covers the header (with the checksum itself zeroed), the
+// other everything after it. Checking the second one reads the whole file
+// once when it is loaded, which XXH3 gets through far faster than the
+// disk delivers it. Entries are bounds checked when they are read as
+// well, so even a file damaged after it was loaded gives wrong results
+// rather than a crash.
+struct snapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t generation;
+    uint64_t checksum;
+    uint64_t payloadChecksum;
+    uint64_t size;
+    uint64_t pathCount;
+    uint64_t tagCount;
+    uint64_t pathOffsets;
+    uint64_t pathData;
+    uint64_t tagOffsets;
+    uint64_t tagData;
+    uint64_t postingOffsets;
+    uint64_t postings;
+};
+
+static const uint64_t *table(const char *data, uint64_t offset) {
+    return reinterpret_cast<const uint64_t *>(data + offset);
+}
+
+static uint64_t header_checksum(snapshotHeader header) {
+    header.checksum = 0;
+    return XXH3_64bits(&header, sizeof(header));
+}
+
+IndexSnapshot::IndexSnapshot() : data(nullptr), size(0) {
+}
+
+IndexSnapshot::~IndexSnapshot() {
+    unload();
+}
+
+QStringList IndexSnapshot::exactMatch(const QStringList &tags) const {
+    TraceScope scope("IndexSnapshot::exactMatch");
+    const snapshotHeader *header = reinterpret_cast<const snapshotHeader *>(data);
+    std::vector<std::pair<const uint32_t *, uint64_t>> includes;
+    std::vector<std::pair<const uint32_t *, uint64_t>> excludes;
+    for (int i = 0; i < tags.size(); ++i) {
+        bool exclude = tags.at(i).startsWith('-');
+        std::string tag = exclude ? tags.at(i).mid(1).toStdString() : tags.at(i).toStdString();
+        uint64_t count;
+        const uint32_t *ids = posting(tag, &count);
+        if (exclude) {
+            excludes.emplace_back(ids, count);
+        } else {
+            includes.emplace_back(ids, count);
+        }
+    }
+
+    // Posting lists are sorted by id, which is the sorted path order, so
+    // plain merges give an already sorted result.
+    std::vector<uint32_t> ids;
+    if (includes.empty()) {
+        ids.resize(header->pathCount);
+        for (uint64_t i = 0; i < header->pathCount; ++i) {
+            ids[i] = i;
+        }
+    } else {
+        std::sort(includes.begin(), includes.end(), [](const auto &a, const auto &b) { return a.second < b.second; });
+        ids.assign(includes[0].first, includes[0].first + includes[0].second);
+        for (size_t i = 1; i < includes.size() && !ids.empty(); ++i) {
+            std::vector<uint32_t> merged;
+            std::set_intersection(ids.begin(), ids.end(), includes[i].first, includes[i].first + includes[i].second,
+                                  std::back_inserter(merged));
+            ids.swap(merged);
+        }
+    }
+    for (size_t i = 0; i < excludes.size() && !ids.empty(); ++i) {
+        std::vector<uint32_t> merged;
+        std::set_difference(ids.begin(), ids.end(), excludes[i].first, excludes[i].first + excludes[i].second,
+                            std::back_inserter(merged));
+        ids.swap(merged);
+    }
+
+    QStringList result;
+    result.reserve(ids.size());
+    for (uint32_t id : ids) {
+        if (id < header->pathCount) {
+            result.append(path(id));
+        }
+    }
+    return result;
+}
+
+// Facet counts straight from the posting lists, which already include
+// implied tags. The paths are turned into a bitmap of ids, so every
+// posting list is a single pass of bit tests. Without paths the counts
+// are just the lengths of the lists.
+QList<QPair<int, QString>> IndexSnapshot::countTags(const QStringList &paths, bool all, int limit,
+                                                    const std::atomic<bool> *cancelled) const {
+    TraceScope scope("IndexSnapshot::countTags");
+    const snapshotHeader *header = reinterpret_cast<const snapshotHeader *>(data);
+    QList<QPair<int, QString>> counts;
+    std::vector<uint64_t> bitmap;
+    if (!all) {
+        bitmap.resize((header->pathCount + 63) / 64, 0);
+        for (int i = 0; i < paths.size(); ++i) {
+            if (i % 1024 == 0 && cancelled && cancelled->load()) {
+                return counts;
+            }
+            int64_t id = find(paths.at(i));
+            if (id >= 0) {
+                bitmap[id / 64] |= uint64_t(1) << (id % 64);
+            }
+        }
+    }
+    const uint64_t *offsets = table(data, header->tagOffsets);
+    const uint64_t *postings = table(data, header->postingOffsets);
+    const uint32_t *ids = reinterpret_cast<const uint32_t *>(data + header->postings);
+    std::vector<std::pair<int, uint64_t>> tags;
+    for (uint64_t tag = 0; tag < header->tagCount; ++tag) {
+        if (cancelled && cancelled->load()) {
+            return counts;
+        }
+        uint64_t begin = postings[tag];
+        uint64_t end = postings[tag + 1];
+        if (begin > end || end > postings[header->tagCount]) {
+            continue;
+        }
+        int count = 0;
+        if (all) {
+            count = end - begin;
+        } else {
+            for (uint64_t i = begin; i < end; ++i) {
+                if (ids[i] < header->pathCount) {
+                    count += (bitmap[ids[i] / 64] >> (ids[i] % 64)) & 1;
+                }
+            }
+        }
+        if (count > 0) {
+            tags.emplace_back(count, tag);
+        }
+    }
+    // Tags are stored sorted, so ties come out in tag order.
+    size_t top = std::min(tags.size(), static_cast<size_t>(limit));
+    std::partial_sort(tags.begin(), tags.begin() + top, tags.end(), [](const auto &a, const auto &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    const char *tag_data = data + header->tagData;
+    for (size_t i = 0; i < top; ++i) {
+        uint64_t tag = tags[i].second;
+        if (offsets[tag] <= offsets[tag + 1] && offsets[tag + 1] <= offsets[header->tagCount]) {
+            counts.append(QPair<int, QString>(tags[i].first, QString::fromUtf8(tag_data + offsets[tag],
+                                                                               offsets[tag + 1] - offsets[tag])));
+        }
+    }
+    return counts;
+}
+
+uint64_t IndexSnapshot::count() const {
+    return data ? reinterpret_cast<const snapshotHeader *>(data)->pathCount : 0;
+}
+
+// The id of a path, or -1. Ids follow the sorted path order, so this is
+// a binary search.
+int64_t IndexSnapshot::find(const QString &path) const {
+    uint64_t low = 0;
+    uint64_t high = count();
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        QString current = this->path(mid);
+        if (current == path) {
+            return mid;
+        }
+        if (current < path) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -1;
+}
+
+uint64_t IndexSnapshot::generation() const {
+    return data ? reinterpret_cast<const snapshotHeader *>(data)->generation : 0;
+}
+
+bool IndexSnapshot::isValid() const {
+    return data != nullptr;
+}
+
+bool IndexSnapshot::load(const fs::path &file, uint64_t generation) {
+    TraceScope scope("IndexSnapshot::load");
+    unload();
+    int fd = open(file.string().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(snapshotHeader)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    data = static_cast<const char *>(map);
+    size = st.st_size;
+
+    const snapshotHeader *header = reinterpret_cast<const snapshotHeader *>(data);
+    bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == SNAPSHOT_VERSION && header->generation == generation &&
+                 header->size == size && header_checksum(*header) == header->checksum &&
+                 XXH3_64bits(data + sizeof(snapshotHeader), size - sizeof(snapshotHeader)) == header->payloadChecksum;
+    // Make sure every table fits before touching any of them.
+    valid = valid && header->pathCount < size && header->tagCount < size;
+    valid = valid && header->pathOffsets + (header->pathCount + 1) * sizeof(uint64_t) <= size &&
+            header->tagOffsets + (header->tagCount + 1) * sizeof(uint64_t) <= size &&
+            header->postingOffsets + (header->tagCount + 1) * sizeof(uint64_t) <= size;
+    valid = valid && header->pathData + table(data, header->pathOffsets)[header->pathCount] <= size &&
+            header->tagData + table(data, header->tagOffsets)[header->tagCount] <= size &&
+            header->postings + table(data, header->postingOffsets)[header->tagCount] * sizeof(uint32_t) <= size;
+    if (!valid) {
+        unload();
+        return false;
+    }
+    return true;
+}
+
+QString IndexSnapshot::path(uint64_t id) const {
+    const snapshotHeader *header = reinterpret_cast<const snapshotHeader *>(data);
+    const uint64_t *offsets = table(data, header->pathOffsets);
+    if (id >= header->pathCount || offsets[id] > offsets[id + 1] || offsets[id + 1] > offsets[header->pathCount]) {
+        return QString();
+    }
+    return QString::fromUtf8(data + header->pathData + offsets[id], offsets[id + 1] - offsets[id]);
+}
+
+QStringList IndexSnapshot::paths() const {
+    TraceScope scope("IndexSnapshot::paths");
+    const snapshotHeader *header = reinterpret_cast<const snapshotHeader *>(data);
+    QStringList result;
+    result.reserve(header->pathCount);
+    for (uint64_t i = 0; i < header->pathCount; ++i) {
+        result.append(path(i));
+    }
+    return result;
+}
+
+const uint32_t *IndexSnapshot::posting(const std::string &tag, uint64_t *count) const {
+    const snapshotHeader *header = reinterpret_cast<const snapshotHeader *>(data);
+    const uint64_t *offsets = table(data, header->tagOffsets);
+    const char *tags = data + header->tagData;
+    // Tags are sorted bytewise so a binary search finds them.
+    uint64_t low = 0;
+    uint64_t high = header->tagCount;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (offsets[mid] > offsets[mid + 1] || offsets[mid + 1] > offsets[header->tagCount]) {
+            break;
+        }
+        std::string_view current(tags + offsets[mid], offsets[mid + 1] - offsets[mid]);
+        int cmp = current.compare(tag);
+        if (cmp == 0) {
+            const uint64_t *postings = table(data, header->postingOffsets);
+            if (postings[mid] > postings[mid + 1] || postings[mid + 1] > postings[header->tagCount]) {
+                break;
+            }
+            *count = postings[mid + 1] - postings[mid];
+            return reinterpret_cast<const uint32_t *>(data + header->postings) + postings[mid];
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *count = 0;
+    return nullptr;
+}
+
+void IndexSnapshot::unload() {
+    if (data) {
+        munmap(const_cast<char *>(data), size);
+    }
+    data = nullptr;
+    size = 0;
+}
+
+static void align_buffer(std::string &buffer) {
+    buffer.resize((buffer.size() + 7) & ~static_cast<size_t>(7), '\0');
+}
+
+template <typename T>
+static void append_raw(std::string &buffer, const T &value) {
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+bool writeSnapshot(sqlite3 *database, const fs::path &file, uint64_t generation) {
+    TraceScope scope("writeSnapshot");
+    sqlite3_stmt *stmt;
+    // Paths are also listed under every tag their tags imply, so the
+    // posting list of a parent tag is already the union of its children.
+    std::string sql = std::string("SELECT path,tag FROM master UNION ALL ") + \
+                      "SELECT master.path, closure.ancestor FROM closure JOIN master ON master.tag = closure.tag";
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        std::cerr << "Error while writing index snapshot: " << sqlite3_errmsg(database) << std::endl;
+        return false;
+    }
+    QSet<QString> path_set;
+    std::map<std::string, QStringList> tag_paths;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        QString path = (const char *)sqlite3_column_text(stmt, 0);
+        path_set.insert(path);
+        if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+            tag_paths[(const char *)sqlite3_column_text(stmt, 1)].append(path);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    QStringList paths(path_set.begin(), path_set.end());
+    paths.sort();
+    QHash<QString, uint32_t> ids;
+    ids.reserve(paths.size());
+    for (int i = 0; i < paths.size(); ++i) {
+        ids.insert(paths.at(i), i);
+    }
+
+    snapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.generation = generation;
+    header.pathCount = paths.size();
+    header.tagCount = tag_paths.size();
+
+    std::string buffer(sizeof(header), '\0');
+
+    std::string path_data;
+    header.pathOffsets = buffer.size();
+    for (int i = 0; i < paths.size(); ++i) {
+        append_raw<uint64_t>(buffer, path_data.size());
+        path_data += paths.at(i).toStdString();
+    }
+    append_raw<uint64_t>(buffer, path_data.size());
+    header.pathData = buffer.size();
+    buffer += path_data;
+    align_buffer(buffer);
+
+    std::string tag_data;
+    header.tagOffsets = buffer.size();
+    for (auto it = tag_paths.begin(); it != tag_paths.end(); ++it) {
+        append_raw<uint64_t>(buffer, tag_data.size());
+        tag_data += it->first;
+    }
+    append_raw<uint64_t>(buffer, tag_data.size());
+    header.tagData = buffer.size();
+    buffer += tag_data;
+    align_buffer(buffer);
+
+    std::string postings;
+    header.postingOffsets = buffer.size();
+    for (auto it = tag_paths.begin(); it != tag_paths.end(); ++it) {
+        append_raw<uint64_t>(buffer, postings.size() / sizeof(uint32_t));
+        std::vector<uint32_t> posting;
+        for (int i = 0; i < it->second.size(); ++i) {
+            posting.push_back(ids.value(it->second.at(i)));
+        }
+        std::sort(posting.begin(), posting.end());
+        posting.erase(std::unique(posting.begin(), posting.end()), posting.end());
+        postings.append(reinterpret_cast<const char *>(posting.data()), posting.size() * sizeof(uint32_t));
+    }
+    append_raw<uint64_t>(buffer, postings.size() / sizeof(uint32_t));
+    header.postings = buffer.size();
+    buffer += postings;
+
+    header.size = buffer.size();
+    header.payloadChecksum = XXH3_64bits(buffer.data() + sizeof(header), buffer.size() - sizeof(header));
+    header.checksum = header_checksum(header);
+    memcpy(&buffer[0], &header, sizeof(header));
+
+    // Write to the side and rename so a reader never sees half a file.
+    fs::path tmp = file;
+    tmp += ".tmp";
+    std::ofstream fout(tmp.string().c_str(), std::ios::binary);
+    fout.write(buffer.data(), buffer.size());
+    fout.close();
+    if (!fout) {
+        std::cerr << "Error while writing index snapshot: " << tmp.string() << std::endl;
+        fs::remove(tmp);
+        return false;
+    }
+    std::error_code ec;
+    fs::rename(tmp, file, ec);
+    if (ec) {
+        std::cerr << "Error while writing index snapshot: " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
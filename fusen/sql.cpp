@@ -14,13 +14,210 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <ostream>
+#include <set>
+#include <vector>
+#include <xxhash.h>
 
+#include "identity.h"
 #include "sql.h"
+#include "trace.h"
 #include "utils.h"
 
+// Only bumped when file metadata changes, which is much rarer than any
+// write, so the in-memory metadata columns aren't reloaded for tag edits.
+static std::atomic<uint64_t> metadata_generation{0};
+
+// With the sharded layout every scan directory gets a database file of its
+// own, attached to each connection as shard0, shard1 and so on. Main keeps
+// the paths outside of them and everything that isn't per path (the
+// implication rules and the settings). Temporary views union the path
+// tables back together so reads don't have to care, but writes have to
+// name the database the path lives in. Longest root first so nested roots
+// win, and loaded once since the registry only changes on the next start.
+struct shardInfo {
+    std::string file;
+    std::string root;
+    std::string schema;
+};
+static std::vector<shardInfo> shards;
+static std::once_flag shards_loaded;
+
+// Tables holding per path rows, which every shard has a copy of. The
+// change log of a path lives next to its rows, so writing to one database
+// never has to lock another one.
+static std::string path_tables(const std::string &schema) {
+    return std::string("CREATE TABLE IF NOT EXISTS ") + schema + ".master (" + \
+           "'index' INTEGER, 'path' TEXT, 'tag' TEXT," + \
+           "PRIMARY KEY('index' AUTOINCREMENT));" + \
+           "CREATE INDEX IF NOT EXISTS " + schema + ".master_path_tag ON master (path, tag);" + \
+           "CREATE INDEX IF NOT EXISTS " + schema + ".master_tag ON master (tag);" + \
+           "CREATE TABLE IF NOT EXISTS " + schema + ".identity (" + \
+           "'path' TEXT PRIMARY KEY, 'size' INTEGER, 'quick' INTEGER, 'full' INTEGER);" + \
+           "CREATE INDEX IF NOT EXISTS " + schema + ".identity_hash ON identity (size, quick);" + \
+           "CREATE TABLE IF NOT EXISTS " + schema + ".metadata (" + \
+           "'path' TEXT PRIMARY KEY, 'size' INTEGER, 'mtime' INTEGER, 'type' TEXT);" + \
+           "CREATE INDEX IF NOT EXISTS " + schema + ".metadata_size ON metadata (size);" + \
+           "CREATE INDEX IF NOT EXISTS " + schema + ".metadata_mtime ON metadata (mtime);" + \
+           "CREATE INDEX IF NOT EXISTS " + schema + ".metadata_type ON metadata (type);" + \
+           "CREATE TABLE IF NOT EXISTS " + schema + ".changes (" + \
+           "'seq' INTEGER PRIMARY KEY AUTOINCREMENT, 'path' TEXT, 'tag' TEXT, 'op' INTEGER, 'time' INTEGER);" + \
+           "CREATE INDEX IF NOT EXISTS " + schema + ".changes_path_tag ON changes (path, tag);" + \
+           "CREATE TABLE IF NOT EXISTS " + schema + ".meta ('key' TEXT PRIMARY KEY, 'value' INTEGER);" + \
+           "INSERT OR IGNORE INTO " + schema + ".meta (key, value) VALUES ('generation', 0);";
+}
+
+static std::string schema_for(const std::string &path) {
+    for (const shardInfo &shard : shards) {
+        if (path.compare(0, shard.root.size(), shard.root) == 0) {
+            return shard.schema;
+        }
+    }
+    return "main";
+}
+
+// What a database is called outside of this connection: "main", or the
+// name of the shard file, which stays the same as long as its root does.
+static std::string database_name(const std::string &schema) {
+    for (const shardInfo &shard : shards) {
+        if (shard.schema == schema) {
+            return fs::path(shard.file).stem().string();
+        }
+    }
+    return "main";
+}
+
+static std::vector<std::string> all_schemas() {
+    std::vector<std::string> schemas = {"main"};
+    for (const shardInfo &shard : shards) {
+        schemas.push_back(shard.schema);
+    }
+    return schemas;
+}
+
+// Splits the paths up by the database they belong in.
+static std::map<std::string, QStringList> group_paths(const QStringList &paths) {
+    std::map<std::string, QStringList> groups;
+    for (int i = 0; i < paths.size(); ++i) {
+        groups[schema_for(paths.at(i).toStdString())].append(paths.at(i));
+    }
+    return groups;
+}
+
+// Bumped on every write so that anything derived from the database
+// contents can tell whether it is stale. Every database counts the writes
+// to it in its own meta table, so writing to a shard never locks main, and
+// the generation is a hash over the counts of all of them. A count is
+// stored before the write happens (or first thing in its transaction), so
+// a crash in between can only make something look stale that isn't, never
+// the other way around. It is only published once the write is done, so
+// nothing read in the meantime gets cached under the new generation.
+static std::mutex generation_mutex;
+static std::map<std::string, uint64_t> generations;
+
+static void publish_generation(const std::string &schema, uint64_t value) {
+    std::lock_guard<std::mutex> lock(generation_mutex);
+    uint64_t &current = generations[schema];
+    current = std::max(current, value);
+}
+
+static uint64_t load_generation(sqlite3 *database, const std::string &schema) {
+    uint64_t value = 0;
+    std::string sql = "SELECT value FROM " + schema + ".meta WHERE key = 'generation'";
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            value = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return value;
+}
+
+// Fills in the new counts, to be published after the commit.
+static bool store_generations(sqlite3 *database, const std::set<std::string> &schemas,
+                              std::map<std::string, uint64_t> *values) {
+    for (const std::string &schema : schemas) {
+        std::string sql = "UPDATE " + schema + ".meta SET value = value + 1 WHERE key = 'generation'";
+        char *err;
+        if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
+            std::cerr << "Error while updating generation: " << err << std::endl;
+            sqlite3_free(err);
+            return false;
+        }
+        (*values)[schema] = load_generation(database, schema);
+    }
+    return true;
+}
+
+static void publish_generations(const std::map<std::string, uint64_t> &values) {
+    for (auto it = values.begin(); it != values.end(); ++it) {
+        publish_generation(it->first, it->second);
+    }
+}
+
+static void bump_generation(sqlite3 *database, const std::string &schema) {
+    std::map<std::string, uint64_t> values;
+    store_generations(database, {schema}, &values);
+    publish_generations(values);
+}
+
+static std::set<std::string> schemas_of(const QStringList &paths) {
+    std::set<std::string> schemas;
+    for (int i = 0; i < paths.size(); ++i) {
+        schemas.insert(schema_for(paths.at(i).toStdString()));
+    }
+    return schemas;
+}
+
+// Fills in the {from} and {to} databases of a statement.
+static std::string in_schemas(std::string sql, const std::string &from, const std::string &to) {
+    const std::pair<std::string, std::string> names[] = {{"{from}", from}, {"{to}", to}};
+    for (const auto &name : names) {
+        for (size_t i = sql.find(name.first); i != std::string::npos; i = sql.find(name.first, i)) {
+            sql.replace(i, name.first.size(), name.second);
+            i += name.second.size();
+        }
+    }
+    return sql;
+}
+
+// A statement that runs against whichever database the path it is bound
+// to lives in, prepared the first time each database comes up.
+struct routedStatement {
+    const char *sql;
+    std::map<std::string, sqlite3_stmt *> prepared;
+};
+
+static sqlite3_stmt *route_statement(sqlite3 *database, routedStatement &statement, const std::string &path) {
+    std::string schema = schema_for(path);
+    auto it = statement.prepared.find(schema);
+    if (it != statement.prepared.end()) {
+        return it->second;
+    }
+    sqlite3_stmt *stmt;
+    std::string sql = in_schemas(statement.sql, schema, schema);
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        return NULL;
+    }
+    statement.prepared.emplace(schema, stmt);
+    return stmt;
+}
+
+static void finalize_routed(routedStatement &statement) {
+    for (auto it = statement.prepared.begin(); it != statement.prepared.end(); ++it) {
+        sqlite3_finalize(it->second);
+    }
+    statement.prepared.clear();
+}
+
 static int path_callback(void *data, int argc, char **argv, char **azColName) {
     QSet<QString> *paths = static_cast<QSet<QString> *>(data);
     for (int i = 0; i < argc; i++) {
@@ -29,20 +226,276 @@ static int path_callback(void *data, int argc, char **argv, char **azColName) {
     return 0;
 }
 
-static void sql_clear_duplicates(sqlite3 *database) {
+static void sql_clear_duplicates(sqlite3 *database, const std::set<std::string> &schemas) {
+    char *err;
+    for (const std::string &schema : schemas) {
+        std::string sql = "DELETE FROM " + schema + ".master WHERE rowid NOT IN " + \
+                          "(select min(rowid) from " + schema + ".master GROUP BY path, tag)";
+        if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
+            std::cerr << "Error while clearing duplicate rows!: " << err << std::endl;
+        }
+    }
+}
+
+// Runs a statement with the strings bound to ?1, ?2 and so on.
+static bool exec_bound(sqlite3 *database, const char *sql, std::initializer_list<std::string> values) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        return false;
+    }
+    int index = 0;
+    for (const std::string &value : values) {
+        sqlite3_bind_text(stmt, ++index, value.c_str(), -1, SQLITE_TRANSIENT);
+    }
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+static std::string shard_file(const std::string &root) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.sqlite", static_cast<unsigned long long>(XXH3_64bits(root.data(), root.size())));
+    return (getUserFile("data").parent_path() / "shards" / name).string();
+}
+
+// Moves every row under the root from one database to another.
+static bool move_rows(sqlite3 *database, const std::string &from, const std::string &to, const std::string &root) {
+    const char *statements[] = {
+        "INSERT INTO {to}.master (path, tag) SELECT path, tag FROM {from}.master AS moved "
+        "WHERE path >= ?1 AND path < ?2 AND NOT EXISTS "
+        "(SELECT 1 FROM {to}.master WHERE path = moved.path AND tag IS moved.tag) ORDER BY \"index\"",
+        "DELETE FROM {from}.master WHERE path >= ?1 AND path < ?2",
+        "INSERT OR REPLACE INTO {to}.identity SELECT * FROM {from}.identity WHERE path >= ?1 AND path < ?2",
+        "DELETE FROM {from}.identity WHERE path >= ?1 AND path < ?2",
+        "INSERT OR REPLACE INTO {to}.metadata SELECT * FROM {from}.metadata WHERE path >= ?1 AND path < ?2",
+        "DELETE FROM {from}.metadata WHERE path >= ?1 AND path < ?2",
+        "INSERT INTO {to}.changes (path, tag, op, time) SELECT path, tag, op, time FROM {from}.changes "
+        "WHERE path >= ?1 AND path < ?2 ORDER BY seq",
+        "DELETE FROM {from}.changes WHERE path >= ?1 AND path < ?2",
+    };
+    // Everything starting with "root/" sorts before "root0".
+    std::string end = root;
+    end.back() = '/' + 1;
+    bool ok = true;
+    for (const char *sql : statements) {
+        ok = ok && exec_bound(database, in_schemas(sql, from, to).c_str(), {root, end});
+    }
+    return ok;
+}
+
+// A shard that was switched off goes back into main and its file is
+// deleted. If the file is gone already, so are its rows.
+static void retire_shard(sqlite3 *database, const std::string &root, const std::string &file) {
+    bool attached = fs::exists(file) && exec_bound(database, "ATTACH DATABASE ?1 AS retired", {file});
+    // Files from older versions lack some of the tables.
+    bool ok = !attached || sqlite3_exec(database, path_tables("retired").c_str(), NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && sqlite3_exec(database, "BEGIN", NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && (!attached || move_rows(database, "retired", "main", root));
+    ok = ok && exec_bound(database, "DELETE FROM main.shards WHERE root = ?1", {root.substr(0, root.size() - 1)});
+    ok = ok && sqlite3_exec(database, "COMMIT", NULL, 0, NULL) == SQLITE_OK;
+    if (!ok) {
+        std::cerr << "Error while merging database of " << root << ": " << sqlite3_errmsg(database) << std::endl;
+        sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
+    }
+    if (attached) {
+        sqlite3_exec(database, "DETACH DATABASE retired", NULL, 0, NULL);
+    }
+    if (ok) {
+        std::error_code ec;
+        fs::remove(file, ec);
+        fs::remove(file + "-shm", ec);
+        fs::remove(file + "-wal", ec);
+    }
+}
+
+// Returns whether a shard was retired, which can change what is in the
+// database.
+static bool load_shards(sqlite3 *database) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, "SELECT root, file, enabled FROM main.shards ORDER BY rowid", -1, &stmt,
+                           NULL) != SQLITE_OK) {
+        std::cerr << "Error while reading shards: " << sqlite3_errmsg(database) << std::endl;
+        return false;
+    }
+    std::vector<shardInfo> retired;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        shardInfo shard;
+        shard.root = std::string((const char *)sqlite3_column_text(stmt, 0)) + "/";
+        shard.file = (const char *)sqlite3_column_text(stmt, 1);
+        (sqlite3_column_int(stmt, 2) ? shards : retired).push_back(shard);
+    }
+    sqlite3_finalize(stmt);
+    // Registries from before the limit was checked can have more than fit.
+    while (static_cast<int>(shards.size()) > sql_get_shard_limit(database)) {
+        std::cerr << "Too many databases, merging the one of " << shards.back().root << " back" << std::endl;
+        retired.push_back(shards.back());
+        shards.pop_back();
+    }
+
+    for (const shardInfo &shard : retired) {
+        retire_shard(database, shard.root, shard.file);
+    }
+    std::stable_sort(shards.begin(), shards.end(), [](const shardInfo &a, const shardInfo &b) {
+        return a.root.size() > b.root.size();
+    });
+    for (size_t i = 0; i < shards.size(); ++i) {
+        shards[i].schema = "shard" + std::to_string(i);
+    }
+    if (!shards.empty()) {
+        fs::create_directories(fs::path(shards.front().file).parent_path());
+    }
+    return !retired.empty();
+}
+
+// Rows written before their shard existed (or before a root nested in
+// another one got its own) are moved to where they belong now.
+static void migrate_shards(sqlite3 *database) {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        std::vector<std::string> sources = {"main"};
+        for (size_t j = i + 1; j < shards.size(); ++j) {
+            if (shards[i].root.compare(0, shards[j].root.size(), shards[j].root) == 0) {
+                sources.push_back(shards[j].schema);
+            }
+        }
+        for (const std::string &source : sources) {
+            bool ok = sqlite3_exec(database, "BEGIN", NULL, 0, NULL) == SQLITE_OK;
+            ok = ok && move_rows(database, source, shards[i].schema, shards[i].root);
+            ok = ok && sqlite3_exec(database, "COMMIT", NULL, 0, NULL) == SQLITE_OK;
+            if (!ok) {
+                std::cerr << "Error while moving rows to database of " << shards[i].root << ": "
+                          << sqlite3_errmsg(database) << std::endl;
+                sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
+            }
+        }
+    }
+}
+
+// A shard that can't be attached on the first connection is left out
+// for the rest of the run, its paths are then kept in main. Later
+// connections can't change the layout anymore, so they just go without.
+static void attach_shards(sqlite3 *database, bool first) {
+    if (shards.empty()) {
+        return;
+    }
+    std::vector<std::string> attached;
+    for (auto it = shards.begin(); it != shards.end();) {
+        std::string attach = "ATTACH DATABASE ?1 AS " + it->schema;
+        std::string sql = "PRAGMA " + it->schema + ".auto_vacuum=INCREMENTAL;" + \
+                          "PRAGMA " + it->schema + ".journal_mode=WAL;" + path_tables(it->schema);
+        bool ok = exec_bound(database, attach.c_str(), {it->file});
+        if (ok && sqlite3_exec(database, sql.c_str(), NULL, 0, NULL) != SQLITE_OK) {
+            std::string detach = "DETACH DATABASE " + it->schema;
+            std::cerr << "Error while creating tables of " << it->root << ": " << sqlite3_errmsg(database) << std::endl;
+            sqlite3_exec(database, detach.c_str(), NULL, 0, NULL);
+            ok = false;
+        } else if (!ok) {
+            std::cerr << "Error while attaching database of " << it->root << ": "
+                      << sqlite3_errmsg(database) << std::endl;
+        }
+        if (ok) {
+            attached.push_back(it->schema);
+        }
+        it = ok || !first ? it + 1 : shards.erase(it);
+    }
+    // The shards split the paths between them, so nothing shows up twice
+    // and lookups by path still use each database's index.
+    std::string sql;
+    for (const char *table : {"master", "identity", "metadata"}) {
+        sql += std::string("CREATE TEMP VIEW ") + table + " AS SELECT * FROM main." + table;
+        for (const std::string &schema : attached) {
+            sql += std::string(" UNION ALL SELECT * FROM ") + schema + "." + table;
+        }
+        sql += ";";
+    }
+    char *err;
+    if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
+        std::cerr << "Error while creating views: " << err << std::endl;
+        sqlite3_free(err);
+    }
+}
+
+// Every write to a path table is recorded in the change log, whichever
+// connection or function it comes from. Rows that only duplicate (or are
+// left behind by) another one aren't a change. Applying changes from
+// elsewhere sets the clock so they keep their original time, and turning
+// logging off leaves out writes that say nothing about what the user
+// wants elsewhere.
+static void log_changes(sqlite3 *database) {
+    std::string sql = "CREATE TEMP TABLE change_clock ('time' INTEGER, 'logging' INTEGER);"
+                      "INSERT INTO temp.change_clock VALUES (NULL, 1);"
+                      "CREATE TEMP TABLE pending_changes ("
+                      "'schema' TEXT, 'path' TEXT, 'tag' TEXT, 'op' INTEGER, 'time' INTEGER);";
+    std::string now = "coalesce((SELECT time FROM temp.change_clock), CAST(strftime('%s', 'now') AS INTEGER))";
+    std::string logging = "(SELECT logging FROM temp.change_clock) AND ";
+    for (const std::string &schema : all_schemas()) {
+        if (!sqlite3_db_filename(database, schema.c_str())) {
+            continue;
+        }
+        std::string insert = "INSERT INTO pending_changes (schema, path, tag, op, time) VALUES ('" + schema + "', ";
+        sql += "CREATE TEMP TRIGGER " + schema + "_master_insert AFTER INSERT ON " + schema + ".master " + \
+               "WHEN " + logging + "(SELECT count(*) FROM " + schema + ".master " + \
+               "WHERE path = new.path AND tag IS new.tag) = 1 " + \
+               "BEGIN " + insert + "new.path, new.tag, 1, " + now + "); END;" + \
+               "CREATE TEMP TRIGGER " + schema + "_master_delete AFTER DELETE ON " + schema + ".master " + \
+               "WHEN " + logging + "NOT EXISTS (SELECT 1 FROM " + schema + ".master " + \
+               "WHERE path = old.path AND tag IS old.tag) " + \
+               "BEGIN " + insert + "old.path, old.tag, 0, " + now + "); END;";
+    }
     char *err;
-    std::string sql = std::string("DELETE FROM master WHERE rowid NOT IN (select min(rowid) from master GROUP BY path, tag)");
     if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
-        std::cerr << "Error while clearing duplicate rows!: " << err << std::endl;
+        std::cerr << "Error while creating change log triggers: " << err << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Temporary triggers can only write to the temporary database, so what
+// they logged waits there and is moved to the change log of the database
+// the path lives in before the write commits. Only the logs of databases
+// that were written to are touched.
+static bool flush_changes(sqlite3 *database) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, "SELECT DISTINCT schema FROM temp.pending_changes", -1, &stmt, NULL) != SQLITE_OK) {
+        return false;
+    }
+    std::vector<std::string> schemas;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        schemas.push_back((const char *)sqlite3_column_text(stmt, 0));
     }
+    sqlite3_finalize(stmt);
+    bool ok = true;
+    for (const std::string &schema : schemas) {
+        std::string sql = "INSERT INTO " + schema + ".changes (path, tag, op, time) " + \
+                          "SELECT path, tag, op, time FROM temp.pending_changes WHERE schema = ?1 ORDER BY rowid";
+        ok = ok && exec_bound(database, sql.c_str(), {schema});
+    }
+    if (!schemas.empty()) {
+        ok = ok && sqlite3_exec(database, "DELETE FROM temp.pending_changes", NULL, 0, NULL) == SQLITE_OK;
+    }
+    return ok;
+}
+
+// Runs a write to one database that would otherwise commit on its own in a
+// transaction together with its part of the change log and its generation.
+static bool exec_logged(sqlite3 *database, const std::string &schema, const std::string &sql, const char *action) {
+    std::map<std::string, uint64_t> new_generations;
+    bool ok = sqlite3_exec(database, "BEGIN", NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && store_generations(database, {schema}, &new_generations);
+    ok = ok && sqlite3_exec(database, sql.c_str(), NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && flush_changes(database);
+    ok = ok && sqlite3_exec(database, "COMMIT", NULL, 0, NULL) == SQLITE_OK;
+    if (!ok) {
+        std::cerr << "Error while " << action << ": " << sqlite3_errmsg(database) << std::endl;
+        sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
+        return false;
+    }
+    publish_generations(new_generations);
+    return true;
 }
 
 sqlite3 *connectDatabase() {
     fs::path file = getUserFile("data");
 
-    bool create_table = false;
     if (!fs::exists(file)) {
-        create_table = true;
         fs::create_directories(file.parent_path());
     }
 
@@ -53,25 +506,65 @@ sqlite3 *connectDatabase() {
         exit(EXIT_FAILURE);
     }
 
-    if (create_table) {
-        char *err;
-        std::string sql = std::string("CREATE TABLE master (") + \
-                        "'index' INTEGER, 'path' TEXT, 'tag' TEXT," + \
-                        "PRIMARY KEY('index' AUTOINCREMENT))";
-        if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
-            std::cerr << "Error while creating table: " << err << std::endl;
-            exit(EXIT_FAILURE);
+    // The tag writer commits from its own connection, so let readers carry
+    // on during its transactions and wait briefly instead of failing on a
+    // locked database.
+    sqlite3_busy_timeout(database, 5000);
+    // Lets maintenance give free pages back a few at a time. Only takes
+    // effect on new databases, older ones need a full vacuum once.
+    sqlite3_exec(database, "PRAGMA auto_vacuum=INCREMENTAL", NULL, 0, NULL);
+    sqlite3_exec(database, "PRAGMA journal_mode=WAL", NULL, 0, NULL);
+
+    // Older databases won't have all of these yet.
+    char *err;
+    std::string sql = path_tables("main") + \
+                    "CREATE TABLE IF NOT EXISTS implication (" + \
+                    "'tag' TEXT, 'implied' TEXT, PRIMARY KEY (tag, implied)) WITHOUT ROWID;" + \
+                    "CREATE TABLE IF NOT EXISTS closure (" + \
+                    "'tag' TEXT, 'ancestor' TEXT, PRIMARY KEY (ancestor, tag)) WITHOUT ROWID;" + \
+                    "CREATE INDEX IF NOT EXISTS closure_tag ON closure (tag);" + \
+                    "CREATE TABLE IF NOT EXISTS shards ('root' TEXT PRIMARY KEY, 'file' TEXT, 'enabled' INTEGER);";
+    if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
+        std::cerr << "Error while creating tables: " << err << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    bool first = false;
+    bool changed = false;
+    std::call_once(shards_loaded, [&] {
+        changed = load_shards(database);
+        attach_shards(database, true);
+        first = true;
+    });
+    if (!first) {
+        attach_shards(database, false);
+    } else {
+        migrate_shards(database);
+    }
+    log_changes(database);
+    for (const std::string &schema : all_schemas()) {
+        if (sqlite3_db_filename(database, schema.c_str())) {
+            publish_generation(schema, load_generation(database, schema));
         }
     }
+    if (changed) {
+        bump_generation(database, "main");
+    }
     return database;
 }
 
 void sql_add_tags(sqlite3 *database, QStringList filenames, QStringList tags)
 {
+    TraceScope scope("sql_add_tags");
+    std::set<std::string> schemas = schemas_of(filenames);
     char *err;
-    std::string sql = std::string("INSERT INTO master (path, tag) VALUES ");
+    sqlite3_exec(database, "BEGIN", NULL, 0, NULL);
+    std::map<std::string, uint64_t> new_generations;
+    store_generations(database, schemas, &new_generations);
     for (int i = 0; i < filenames.size(); ++i) {
-        std::string sql_query = sql + "('" + sanitize_path(filenames.at(i).toStdString()) + "','";
+        std::string path = filenames.at(i).toStdString();
+        std::string sql_query = "INSERT INTO " + schema_for(path) + ".master (path, tag) VALUES ('" + \
+                                sanitize_path(path) + "','";
         for (int j = 0; j < tags.size(); ++j) {
              std::string sql_final = sql_query + tags.at(j).toStdString() + "')";
             if (sqlite3_exec(database, sql_final.c_str(), NULL, 0, &err)) {
@@ -79,7 +572,239 @@ void sql_add_tags(sqlite3 *database, QStringList filenames, QStringList tags)
             }
         }
     }
-    sql_clear_duplicates(database);
+    sql_clear_duplicates(database, schemas);
+    if (!flush_changes(database)) {
+        std::cerr << "Error while logging tags: " << sqlite3_errmsg(database) << std::endl;
+    }
+    sqlite3_exec(database, "COMMIT", NULL, 0, NULL);
+    publish_generations(new_generations);
+}
+
+// Counts the rows it changed.
+static bool run_routed(sqlite3 *database, routedStatement &statement, const std::string &path, const std::string &tag,
+                       int *changed) {
+    sqlite3_stmt *stmt = route_statement(database, statement, path);
+    if (!stmt) {
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+    if (sqlite3_bind_parameter_count(stmt) > 1) {
+        sqlite3_bind_text(stmt, 2, tag.c_str(), -1, SQLITE_TRANSIENT);
+    }
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+    *changed += ok ? sqlite3_changes(database) : 0;
+    return ok;
+}
+
+// Whether a change to the path could belong here at all, which is if it
+// is under one of the scan directories (or already in the database).
+static bool under_roots(const QString &path, const QStringList &roots) {
+    for (int i = 0; i < roots.size(); ++i) {
+        QString root = roots.at(i);
+        while (root.size() > 1 && root.endsWith('/')) {
+            root.chop(1);
+        }
+        if (path == root || path.startsWith(root.endsWith('/') ? root : root + "/")) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A change made here later than the incoming one to the same tag (or a
+// later removal of the whole path) wins over it, and a removed path loses
+// against any later change to it. Later goes by the clocks of the machines
+// the changes were made on, so a clock that is off decides. Of two changes
+// made at the same time the removal wins, whichever side it came from, so
+// both end up the same. Paths that aren't here yet are only added if they
+// are under one of the roots, files elsewhere would just be pruned again.
+// Everything else is only applied as far as it still changes anything, so
+// applying the same changes twice does nothing the second time, and only
+// changes that did change something count as applied. All or nothing.
+bool sql_apply_changes(sqlite3 *database, QList<tagChange> changes, QStringList roots, int *applied, int *skipped) {
+    TraceScope scope("sql_apply_changes");
+    *applied = 0;
+    *skipped = 0;
+    sqlite3_stmt *clock;
+    if (sqlite3_prepare_v2(database, "UPDATE temp.change_clock SET time = ?1", -1, &clock, NULL) != SQLITE_OK) {
+        std::cerr << "Error while applying changes: " << sqlite3_errmsg(database) << std::endl;
+        return false;
+    }
+    routedStatement newer = {"SELECT 1 FROM {to}.changes WHERE path = ?1 "
+                             "AND (time > ?3 OR (time = ?3 AND ?5 AND op = 0)) "
+                             "AND (?4 OR tag IS ?2 OR (tag IS NULL AND op = 0)) LIMIT 1", {}};
+    routedStatement known = {"SELECT 1 FROM {to}.master WHERE path = ?1 LIMIT 1", {}};
+    routedStatement add_path = {"INSERT INTO {to}.master (path) SELECT ?1 "
+                                "WHERE NOT EXISTS (SELECT 1 FROM {to}.master WHERE path = ?1 AND tag IS NULL)", {}};
+    routedStatement add_tag = {"INSERT INTO {to}.master (path, tag) SELECT ?1, ?2 "
+                               "WHERE NOT EXISTS (SELECT 1 FROM {to}.master WHERE path = ?1 AND tag = ?2)", {}};
+    routedStatement remove_tag = {"DELETE FROM {to}.master WHERE path = ?1 AND tag = ?2", {}};
+    routedStatement remove_path[] = {
+        {"DELETE FROM {to}.master WHERE path = ?1", {}},
+        {"DELETE FROM {to}.identity WHERE path = ?1", {}},
+        {"DELETE FROM {to}.metadata WHERE path = ?1", {}},
+    };
+
+    QStringList paths;
+    for (int i = 0; i < changes.size(); ++i) {
+        paths.append(changes.at(i).path);
+    }
+    std::map<std::string, uint64_t> new_generations;
+    bool ok = sqlite3_exec(database, "BEGIN", NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && store_generations(database, schemas_of(paths), &new_generations);
+    bool removed_paths = false;
+    for (int i = 0; i < changes.size() && ok; ++i) {
+        const tagChange &change = changes.at(i);
+        std::string path = change.path.toStdString();
+        std::string tag = change.tag.toStdString();
+        bool whole_path = change.tag.isEmpty() && !change.add;
+        sqlite3_stmt *stmt = route_statement(database, newer, path);
+        if (!stmt) {
+            ok = false;
+            break;
+        }
+        sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+        if (change.tag.isEmpty()) {
+            sqlite3_bind_null(stmt, 2);
+        } else {
+            sqlite3_bind_text(stmt, 2, tag.c_str(), -1, SQLITE_TRANSIENT);
+        }
+        sqlite3_bind_int64(stmt, 3, change.time);
+        sqlite3_bind_int(stmt, 4, whole_path);
+        sqlite3_bind_int(stmt, 5, change.add);
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc == SQLITE_DONE && change.add && !under_roots(change.path, roots)) {
+            stmt = route_statement(database, known, path);
+            if (!stmt) {
+                ok = false;
+                break;
+            }
+            sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+            rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_DONE : SQLITE_ROW;
+            sqlite3_reset(stmt);
+        }
+        if (rc == SQLITE_ROW) {
+            ++*skipped;
+            continue;
+        }
+        sqlite3_bind_int64(clock, 1, change.time);
+        ok = rc == SQLITE_DONE && sqlite3_step(clock) == SQLITE_DONE;
+        sqlite3_reset(clock);
+        int changed = 0;
+        if (change.add) {
+            ok = ok && run_routed(database, add_path, path, tag, &changed);
+            ok = ok && (change.tag.isEmpty() || run_routed(database, add_tag, path, tag, &changed));
+        } else if (whole_path) {
+            for (routedStatement &statement : remove_path) {
+                ok = ok && run_routed(database, statement, path, tag, &changed);
+            }
+            removed_paths = true;
+        } else {
+            ok = ok && run_routed(database, remove_tag, path, tag, &changed);
+        }
+        *applied += changed > 0;
+    }
+    ok = ok && sqlite3_exec(database, "UPDATE temp.change_clock SET time = NULL", NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && flush_changes(database);
+    sqlite3_finalize(clock);
+    finalize_routed(newer);
+    finalize_routed(known);
+    finalize_routed(add_path);
+    finalize_routed(add_tag);
+    finalize_routed(remove_tag);
+    for (routedStatement &statement : remove_path) {
+        finalize_routed(statement);
+    }
+    ok = ok && sqlite3_exec(database, "COMMIT", NULL, 0, NULL) == SQLITE_OK;
+    if (!ok) {
+        std::cerr << "Error while applying changes: " << sqlite3_errmsg(database) << std::endl;
+        sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
+        return false;
+    }
+    publish_generations(new_generations);
+    if (removed_paths) {
+        ++metadata_generation;
+    }
+    return true;
+}
+
+// The error code is SQLITE_OK on success.
+bool sql_apply_tag_mutations(sqlite3 *database, QHash<QPair<QString, QString>, bool> mutations, int *error) {
+    TraceScope scope("sql_apply_tag_mutations");
+    routedStatement add_stmt = {"INSERT INTO {to}.master (path, tag) SELECT ?1, ?2 "
+                                "WHERE NOT EXISTS (SELECT 1 FROM {to}.master WHERE path = ?1 AND tag = ?2)", {}};
+    routedStatement remove_stmt = {"DELETE FROM {to}.master WHERE path = ?1 AND tag = ?2", {}};
+
+    // Everything goes into one transaction, generation bumps included. It
+    // is deferred so that only the databases that are written get locked,
+    // and since their generations are written first it never has to
+    // upgrade a read lock.
+    std::set<std::string> schemas;
+    for (auto it = mutations.begin(); it != mutations.end(); ++it) {
+        schemas.insert(schema_for(it.key().first.toStdString()));
+    }
+    std::map<std::string, uint64_t> new_generations;
+    bool ok = sqlite3_exec(database, "BEGIN", NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && store_generations(database, schemas, &new_generations);
+    for (auto it = mutations.begin(); it != mutations.end() && ok; ++it) {
+        std::string path = it.key().first.toStdString();
+        std::string tag = it.key().second.toStdString();
+        sqlite3_stmt *stmt = route_statement(database, it.value() ? add_stmt : remove_stmt, path);
+        if (!stmt) {
+            ok = false;
+            break;
+        }
+        sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, tag.c_str(), -1, SQLITE_TRANSIENT);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_reset(stmt);
+    }
+    finalize_routed(add_stmt);
+    finalize_routed(remove_stmt);
+    ok = ok && flush_changes(database);
+    if (ok) {
+        ok = sqlite3_exec(database, "COMMIT", NULL, 0, NULL) == SQLITE_OK;
+    }
+    *error = ok ? SQLITE_OK : sqlite3_errcode(database);
+    if (!ok) {
+        std::cerr << "Error while updating tags: " << sqlite3_errmsg(database) << std::endl;
+        sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
+        return false;
+    }
+    publish_generations(new_generations);
+    return true;
+}
+
+// The closure table holds a row for every tag and every tag it implies,
+// directly or not, so looking up everything under a tag is one indexed
+// read. Adding a rule links everything under the tag to everything above
+// the implied tag.
+bool sql_add_implication(sqlite3 *database, QString tag, QString implied) {
+    TraceScope scope("sql_add_implication");
+    if (tag == implied) {
+        return false;
+    }
+    const char *closure_sql = "INSERT OR IGNORE INTO closure (tag, ancestor) SELECT below.tag, above.ancestor FROM "
+                              "(SELECT ?1 AS tag UNION SELECT tag FROM closure WHERE ancestor = ?1) AS below, "
+                              "(SELECT ?2 AS ancestor UNION SELECT ancestor FROM closure WHERE tag = ?2) AS above "
+                              "WHERE below.tag != above.ancestor";
+    std::string first = tag.toStdString();
+    std::string second = implied.toStdString();
+    std::map<std::string, uint64_t> new_generations;
+    bool ok = sqlite3_exec(database, "BEGIN", NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && store_generations(database, {"main"}, &new_generations);
+    ok = ok && exec_bound(database, "INSERT OR IGNORE INTO implication (tag, implied) VALUES (?1, ?2)", {first, second});
+    ok = ok && exec_bound(database, closure_sql, {first, second});
+    ok = ok && sqlite3_exec(database, "COMMIT", NULL, 0, NULL) == SQLITE_OK;
+    if (!ok) {
+        std::cerr << "Error while adding implication: " << sqlite3_errmsg(database) << std::endl;
+        sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
+        return false;
+    }
+    publish_generations(new_generations);
+    return true;
 }
 
 void sql_clear_tags(sqlite3 *database, QStringList filenames) {
@@ -89,55 +814,521 @@ void sql_clear_tags(sqlite3 *database, QStringList filenames) {
 }
 
 bool sql_add_paths(sqlite3 *database, QStringList paths) {
-    std::string sql = std::string("INSERT INTO master (path) VALUES ");
-    for (int i = 0; i < paths.size(); ++i) {
-        std::string str = sanitize_path(paths.at(i).toStdString());
-        sql += "('" + str + "'),";
-    }
-    // Replace trailing comma
-    sql.pop_back();
-    sql += ';';
-    char *err;
-    if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
-        std::cerr << "Error while adding files: " << err << std::endl;
-        return false;
+    TraceScope scope("sql_add_paths");
+    std::map<std::string, QStringList> groups = group_paths(paths);
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+        std::string sql = "INSERT INTO " + it->first + ".master (path) VALUES ";
+        for (int i = 0; i < it->second.size(); ++i) {
+            std::string str = sanitize_path(it->second.at(i).toStdString());
+            sql += "('" + str + "'),";
+        }
+        // Replace trailing comma
+        sql.pop_back();
+        sql += ';';
+        if (!exec_logged(database, it->first, sql, "adding files")) {
+            return false;
+        }
     }
     return true;
 }
 
+static fileIdentity identity_from_row(sqlite3_stmt *stmt, int column) {
+    fileIdentity identity;
+    identity.size = sqlite3_column_int64(stmt, column);
+    identity.quick = sqlite3_column_int64(stmt, column + 1);
+    identity.full = sqlite3_column_int64(stmt, column + 2);
+    return identity;
+}
+
+// Implied tags are counted as well since searching for them finds these
+// paths. The paths go into a temporary table so the counting is a single
+// grouped join over the path index, most common tags first. Without
+// paths every path in the database is counted. Returns early (with
+// nothing) once cancelled is set.
+QList<QPair<int, QString>> sql_count_tags(sqlite3 *database, QStringList paths, bool all, int limit,
+                                          const std::atomic<bool> *cancelled) {
+    TraceScope scope("sql_count_tags");
+    QList<QPair<int, QString>> counts;
+    std::string source = "master";
+    if (!all) {
+        // Only the temporary database is written, so this never waits for
+        // (or blocks) writers.
+        char *err;
+        if (sqlite3_exec(database, "CREATE TEMP TABLE IF NOT EXISTS facet_paths (path TEXT PRIMARY KEY) WITHOUT ROWID;"
+                                   "DELETE FROM temp.facet_paths", NULL, 0, &err)) {
+            std::cerr << "Error while counting tags: " << err << std::endl;
+            sqlite3_free(err);
+            return counts;
+        }
+        sqlite3_stmt *insert;
+        if (sqlite3_prepare_v2(database, "INSERT OR IGNORE INTO temp.facet_paths (path) VALUES (?)", -1, &insert,
+                               NULL) != SQLITE_OK) {
+            std::cerr << "Error while counting tags: " << sqlite3_errmsg(database) << std::endl;
+            return counts;
+        }
+        sqlite3_exec(database, "BEGIN", NULL, 0, NULL);
+        for (int i = 0; i < paths.size(); ++i) {
+            if (i % 1024 == 0 && cancelled && cancelled->load()) {
+                break;
+            }
+            std::string path = paths.at(i).toStdString();
+            sqlite3_bind_text(insert, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_step(insert);
+            sqlite3_reset(insert);
+        }
+        sqlite3_finalize(insert);
+        sqlite3_exec(database, "COMMIT", NULL, 0, NULL);
+        source = "temp.facet_paths JOIN master ON master.path = facet_paths.path";
+    }
+    if (cancelled && cancelled->load()) {
+        return counts;
+    }
+
+    std::string sql = "SELECT tag, count(*) FROM (SELECT master.path, master.tag FROM " + source + " " + \
+                      "WHERE master.tag IS NOT NULL UNION " + \
+                      "SELECT master.path, closure.ancestor FROM " + source + " " + \
+                      "JOIN closure ON closure.tag = master.tag) " + \
+                      "GROUP BY tag ORDER BY 2 DESC, 1 LIMIT " + std::to_string(limit);
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        std::cerr << "Error while counting tags: " << sqlite3_errmsg(database) << std::endl;
+        return counts;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        counts.append(QPair<int, QString>(sqlite3_column_int(stmt, 1), (const char *)sqlite3_column_text(stmt, 0)));
+    }
+    sqlite3_finalize(stmt);
+    return counts;
+}
+
+QHash<QString, fileIdentity> sql_find_identities(sqlite3 *database, int64_t size, uint64_t quick) {
+    QHash<QString, fileIdentity> identities;
+    sqlite3_stmt *stmt;
+    std::string sql = std::string("SELECT path,size,quick,full FROM identity WHERE size = ? AND quick = ?");
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        std::cerr << "Error while finding identities: " << sqlite3_errmsg(database) << std::endl;
+        return identities;
+    }
+    sqlite3_bind_int64(stmt, 1, size);
+    sqlite3_bind_int64(stmt, 2, quick);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        identities.insert((const char *)sqlite3_column_text(stmt, 0), identity_from_row(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+    return identities;
+}
+
+// Only the last change of every path and tag is needed to get from one
+// state to the next, so earlier ones are left out. Every database numbers
+// its changes on its own, so where to start (and where this ended) is one
+// sequence number per database. The changes of all of them are merged by
+// time.
+QList<tagChange> sql_get_changes(sqlite3 *database, const changeCursor &since, changeCursor *last) {
+    TraceScope scope("sql_get_changes");
+    QList<tagChange> changes;
+    *last = since;
+    for (const std::string &schema : all_schemas()) {
+        QString name = database_name(schema).c_str();
+        std::string sql = "SELECT seq, path, tag, op, time FROM " + schema + ".changes AS change " + \
+                          "WHERE seq > ?1 AND NOT EXISTS (SELECT 1 FROM " + schema + ".changes AS later " + \
+                          "WHERE later.path = change.path AND later.tag IS change.tag " + \
+                          "AND later.seq > change.seq) ORDER BY seq";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+            std::cerr << "Error while reading changes: " << sqlite3_errmsg(database) << std::endl;
+            continue;
+        }
+        sqlite3_bind_int64(stmt, 1, since.value(name, 0));
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            tagChange change;
+            change.seq = sqlite3_column_int64(stmt, 0);
+            change.path = (const char *)sqlite3_column_text(stmt, 1);
+            change.tag = sqlite3_column_type(stmt, 2) == SQLITE_NULL ? "" : (const char *)sqlite3_column_text(stmt, 2);
+            change.add = sqlite3_column_int(stmt, 3) != 0;
+            change.time = sqlite3_column_int64(stmt, 4);
+            changes.append(change);
+            last->insert(name, change.seq);
+        }
+        sqlite3_finalize(stmt);
+    }
+    std::stable_sort(changes.begin(), changes.end(), [](const tagChange &a, const tagChange &b) {
+        return a.time < b.time;
+    });
+    return changes;
+}
+
+uint64_t sql_get_generation() {
+    std::string counts;
+    std::lock_guard<std::mutex> lock(generation_mutex);
+    for (auto it = generations.begin(); it != generations.end(); ++it) {
+        counts += database_name(it->first) + ":" + std::to_string(it->second) + ",";
+    }
+    return XXH3_64bits(counts.data(), counts.size());
+}
+
+QList<QPair<QString, QString>> sql_get_implications(sqlite3 *database) {
+    QList<QPair<QString, QString>> implications;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, "SELECT tag, implied FROM implication ORDER BY tag, implied", -1, &stmt, NULL) != SQLITE_OK) {
+        std::cerr << "Error while reading implications: " << sqlite3_errmsg(database) << std::endl;
+        return implications;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        implications.append(QPair<QString, QString>((const char *)sqlite3_column_text(stmt, 0),
+                                                    (const char *)sqlite3_column_text(stmt, 1)));
+    }
+    sqlite3_finalize(stmt);
+    return implications;
+}
+
+QHash<QString, fileIdentity> sql_get_identities(sqlite3 *database, QStringList paths) {
+    TraceScope scope("sql_get_identities");
+    QHash<QString, fileIdentity> identities;
+    sqlite3_stmt *stmt;
+    std::string sql = std::string("SELECT size,quick,full FROM identity WHERE path = ? AND size > 0");
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        std::cerr << "Error while reading identities: " << sqlite3_errmsg(database) << std::endl;
+        return identities;
+    }
+    for (int i = 0; i < paths.size(); ++i) {
+        std::string path = paths.at(i).toStdString();
+        sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            identities.insert(paths.at(i), identity_from_row(stmt, 0));
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return identities;
+}
+
 QSet<QString> sql_get_paths(sqlite3 *database) {
+    TraceScope scope("sql_get_paths");
     QSet<QString> paths;
     std::string sql = std::string("SELECT DISTINCT path FROM master");
     char *err;
     if (sqlite3_exec(database, sql.c_str(), path_callback, static_cast<void *>(&paths), &err)) {
         std::cerr << "Error while reading paths: " << err << std::endl;
     }
+    trace_counter("paths", paths.size());
     return paths;
 }
 
-bool sql_remove_paths(sqlite3 *database, QStringList paths) {
-    std::string sql = std::string("DELETE FROM master WHERE (path) IN (");
-    for (int i = 0; i < paths.size(); ++i) {
-        std::string str = sanitize_path(paths.at(i).toStdString());
-        sql += "('" + str + "'),";
+QHash<QString, fileMetadata> sql_get_metadata(sqlite3 *database) {
+    TraceScope scope("sql_get_metadata");
+    QHash<QString, fileMetadata> metadata;
+    sqlite3_stmt *stmt;
+    std::string sql = std::string("SELECT path, size, mtime, type FROM metadata");
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        std::cerr << "Error while reading metadata: " << sqlite3_errmsg(database) << std::endl;
+        return metadata;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        fileMetadata row;
+        row.size = sqlite3_column_int64(stmt, 1);
+        row.mtime = sqlite3_column_int64(stmt, 2);
+        row.type = (const char *)sqlite3_column_text(stmt, 3);
+        metadata.insert((const char *)sqlite3_column_text(stmt, 0), row);
+    }
+    sqlite3_finalize(stmt);
+    return metadata;
+}
+
+uint64_t sql_get_metadata_generation() {
+    return metadata_generation;
+}
+
+// Grows with every change to any of the databases.
+int64_t sql_get_last_change(sqlite3 *database) {
+    int64_t seq = 0;
+    for (const std::string &schema : all_schemas()) {
+        std::string sql = "SELECT max(seq) FROM " + schema + ".changes";
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                seq += sqlite3_column_int64(stmt, 0);
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+    return seq;
+}
+
+// Bookkeeping values kept next to the generation, zero if never set.
+int64_t sql_get_meta(sqlite3 *database, const char *key) {
+    int64_t value = 0;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, "SELECT value FROM main.meta WHERE key = ?", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            value = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return value;
+}
+
+std::string sql_get_meta_text(sqlite3 *database, const char *key) {
+    std::string value;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, "SELECT value FROM main.meta WHERE key = ?", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+            value = (const char *)sqlite3_column_text(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return value;
+}
+
+// The names of the attached databases, main first.
+QStringList sql_get_schemas() {
+    QStringList schemas;
+    for (const std::string &schema : all_schemas()) {
+        schemas.append(schema.c_str());
+    }
+    return schemas;
+}
+
+QStringList sql_get_shard_files() {
+    QStringList files;
+    for (const shardInfo &shard : shards) {
+        files.append(shard.file.c_str());
+    }
+    return files;
+}
+
+// How many shards can be attached next to main.
+int sql_get_shard_limit(sqlite3 *database) {
+    return sqlite3_limit(database, SQLITE_LIMIT_ATTACHED, -1);
+}
+
+QStringList sql_get_shard_roots() {
+    QStringList roots;
+    for (const shardInfo &shard : shards) {
+        roots.append(shard.root.substr(0, shard.root.size() - 1).c_str());
+    }
+    return roots;
+}
+
+QSet<QString> sql_get_tagged_paths(sqlite3 *database) {
+    TraceScope scope("sql_get_tagged_paths");
+    QSet<QString> paths;
+    std::string sql = std::string("SELECT DISTINCT path FROM master WHERE tag IS NOT NULL");
+    char *err;
+    if (sqlite3_exec(database, sql.c_str(), path_callback, static_cast<void *>(&paths), &err)) {
+        std::cerr << "Error while reading tagged paths: " << err << std::endl;
     }
-    // Remove trailing comma
-    sql.pop_back();
-    sql += ");";
+    return paths;
+}
+
+// Files that couldn't be hashed have an identity of size zero, so they
+// aren't tried again.
+QStringList sql_get_unidentified_paths(sqlite3 *database) {
+    TraceScope scope("sql_get_unidentified_paths");
+    QSet<QString> paths;
+    std::string sql = std::string("SELECT DISTINCT path FROM master WHERE path NOT IN (SELECT path FROM identity)");
     char *err;
-    if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
-        std::cerr << "Error while removing files: " << err << std::endl;
+    if (sqlite3_exec(database, sql.c_str(), path_callback, static_cast<void *>(&paths), &err)) {
+        std::cerr << "Error while reading unidentified paths: " << err << std::endl;
+    }
+    return QStringList(paths.begin(), paths.end());
+}
+
+// The paths of a table of (path, tag) rows that match the search.
+static std::string entries_sql(const QStringList &tags, bool exact, const std::string &table) {
+    std::string sql = "SELECT DISTINCT path FROM " + table + " ";
+    for (int i = 0; i < tags.size(); ++i) {
+        std::string tag = tags.at(i).toStdString();
+        bool exclude = false;
+        if (tags.at(i)[0] == '-') {
+            tag = tags.at(i).mid(1).toStdString();
+            exclude = true;
+        }
+        sql += exclude ? "EXCEPT " : "INTERSECT ";
+        // Tags that imply the searched one count as a match too.
+        std::string match = exact ? "= '" + tag + "' " : "LIKE '%" + tag + "%' ";
+        sql += "SELECT * FROM (SELECT path FROM " + table + " WHERE tag " + match + \
+               "UNION SELECT tagged.path FROM closure JOIN " + table + " AS tagged ON tagged.tag = closure.tag " + \
+               "WHERE closure.ancestor " + match + ") ";
+    }
+    return sql;
+}
+
+// Which of the edited paths match the search once the edits are applied,
+// so edits can be shown before they are committed. The edits go into a
+// temporary table that stands in for the rows of those paths.
+QSet<QString> sql_match_edits(sqlite3 *database, QHash<QPair<QString, QString>, bool> edits, QStringList tags,
+                              bool exact) {
+    TraceScope scope("sql_match_edits");
+    QSet<QString> entries;
+    bool ok = sqlite3_exec(database, "CREATE TEMP TABLE IF NOT EXISTS edits (path TEXT, tag TEXT, 'add' INTEGER);"
+                           "DELETE FROM temp.edits", NULL, 0, NULL) == SQLITE_OK;
+    sqlite3_stmt *stmt;
+    ok = ok && sqlite3_prepare_v2(database, "INSERT INTO temp.edits VALUES (?, ?, ?)", -1, &stmt, NULL) == SQLITE_OK;
+    if (ok) {
+        for (auto it = edits.begin(); it != edits.end(); ++it) {
+            std::string path = it.key().first.toStdString();
+            std::string tag = it.key().second.toStdString();
+            sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(stmt, 2, tag.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 3, it.value());
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+        sqlite3_finalize(stmt);
+    }
+    std::string sql = "WITH edited (path, tag) AS ("
+                      "SELECT path, tag FROM master WHERE path IN (SELECT path FROM temp.edits) AND NOT EXISTS "
+                      "(SELECT 1 FROM temp.edits WHERE edits.path = master.path AND edits.tag = master.tag) "
+                      "UNION SELECT path, tag FROM temp.edits WHERE \"add\") " + entries_sql(tags, exact, "edited");
+    char *err;
+    if (ok && sqlite3_exec(database, sql.c_str(), path_callback, static_cast<void *>(&entries), &err)) {
+        std::cerr << "Error while matching edits: " << err << std::endl;
+        sqlite3_free(err);
+        entries.clear();
+    }
+    sqlite3_exec(database, "DELETE FROM temp.edits", NULL, 0, NULL);
+    return entries;
+}
+
+bool sql_move_paths(sqlite3 *database, QList<QPair<QString, QString>> moves) {
+    TraceScope scope("sql_move_paths");
+    if (moves.isEmpty()) {
+        return true;
+    }
+    // The new path was already added by the scan, so drop that bare entry
+    // and let the old rows (tags included) take its place. The two paths
+    // can be in different databases, so the rows are copied over instead
+    // of renamed. Only the tags and the identity move, the metadata the
+    // scan just read for the new path is newer than the old one.
+    const char *statements[] = {
+        "DELETE FROM {to}.master WHERE path = ?2",
+        "INSERT INTO {to}.master (path, tag) SELECT ?2, tag FROM {from}.master WHERE path = ?1 ORDER BY \"index\"",
+        "DELETE FROM {from}.master WHERE path = ?1",
+        "DELETE FROM {to}.identity WHERE path = ?2",
+        "INSERT INTO {to}.identity (path, size, quick, full) SELECT ?2, size, quick, full FROM {from}.identity WHERE path = ?1",
+        "DELETE FROM {from}.identity WHERE path = ?1",
+        "DELETE FROM {from}.metadata WHERE path = ?1",
+    };
+    std::set<std::string> schemas;
+    for (int i = 0; i < moves.size(); ++i) {
+        schemas.insert(schema_for(moves.at(i).first.toStdString()));
+        schemas.insert(schema_for(moves.at(i).second.toStdString()));
+    }
+    ++metadata_generation;
+    std::map<std::string, uint64_t> new_generations;
+    sqlite3_exec(database, "BEGIN", NULL, 0, NULL);
+    bool ok = store_generations(database, schemas, &new_generations);
+    for (int i = 0; i < moves.size() && ok; ++i) {
+        std::string from = moves.at(i).first.toStdString();
+        std::string to = moves.at(i).second.toStdString();
+        for (const char *sql : statements) {
+            std::string routed = in_schemas(sql, schema_for(from), schema_for(to));
+            if (!exec_bound(database, routed.c_str(), {from, to})) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    ok = ok && flush_changes(database);
+    if (!ok) {
+        std::cerr << "Error while moving files: " << sqlite3_errmsg(database) << std::endl;
+        sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
+        return false;
+    }
+    sqlite3_exec(database, "COMMIT", NULL, 0, NULL);
+    publish_generations(new_generations);
+    return true;
+}
+
+// Another path might still connect a tag to what the removed rule
+// implied, so the ancestors of the tag and everything under it are
+// recomputed from the remaining rules. The rest of the closure is left as
+// it is.
+bool sql_remove_implication(sqlite3 *database, QString tag, QString implied) {
+    TraceScope scope("sql_remove_implication");
+    const char *affected_sql = "SELECT ?1 UNION SELECT tag FROM closure WHERE ancestor = ?1";
+    const char *closure_sql = "WITH RECURSIVE above(ancestor) AS ("
+                              "SELECT implied FROM implication WHERE tag = ?1 UNION "
+                              "SELECT implication.implied FROM implication JOIN above ON implication.tag = above.ancestor) "
+                              "INSERT OR IGNORE INTO closure (tag, ancestor) SELECT ?1, ancestor FROM above WHERE ancestor != ?1";
+    std::string first = tag.toStdString();
+    std::string second = implied.toStdString();
+    std::map<std::string, uint64_t> new_generations;
+    bool ok = sqlite3_exec(database, "BEGIN", NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && store_generations(database, {"main"}, &new_generations);
+
+    std::vector<std::string> affected;
+    sqlite3_stmt *stmt;
+    ok = ok && sqlite3_prepare_v2(database, affected_sql, -1, &stmt, NULL) == SQLITE_OK;
+    if (ok) {
+        sqlite3_bind_text(stmt, 1, first.c_str(), -1, SQLITE_TRANSIENT);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            affected.push_back((const char *)sqlite3_column_text(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    ok = ok && exec_bound(database, "DELETE FROM implication WHERE tag = ?1 AND implied = ?2", {first, second});
+    for (size_t i = 0; i < affected.size() && ok; ++i) {
+        ok = exec_bound(database, "DELETE FROM closure WHERE tag = ?1", {affected[i]}) &&
+             exec_bound(database, closure_sql, {affected[i]});
+    }
+    ok = ok && sqlite3_exec(database, "COMMIT", NULL, 0, NULL) == SQLITE_OK;
+    if (!ok) {
+        std::cerr << "Error while removing implication: " << sqlite3_errmsg(database) << std::endl;
+        sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
         return false;
     }
+    publish_generations(new_generations);
+    return true;
+}
+
+// Removes paths without logging it, for files that are gone or no longer
+// scanned here. Unlike a removal by the user that says nothing about the
+// same files elsewhere.
+bool sql_forget_paths(sqlite3 *database, QStringList paths) {
+    sqlite3_exec(database, "UPDATE temp.change_clock SET logging = 0", NULL, 0, NULL);
+    bool ok = sql_remove_paths(database, paths);
+    sqlite3_exec(database, "UPDATE temp.change_clock SET logging = 1", NULL, 0, NULL);
+    return ok;
+}
+
+bool sql_remove_paths(sqlite3 *database, QStringList paths) {
+    TraceScope scope("sql_remove_paths");
+    ++metadata_generation;
+    std::map<std::string, QStringList> groups = group_paths(paths);
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+        std::string list;
+        for (int i = 0; i < it->second.size(); ++i) {
+            std::string str = sanitize_path(it->second.at(i).toStdString());
+            list += "('" + str + "'),";
+        }
+        // Remove trailing comma
+        list.pop_back();
+        const std::string &schema = it->first;
+        std::string sql = "DELETE FROM " + schema + ".master WHERE (path) IN (" + list + ");" + \
+                          "DELETE FROM " + schema + ".identity WHERE (path) IN (" + list + ");" + \
+                          "DELETE FROM " + schema + ".metadata WHERE (path) IN (" + list + ");";
+        if (!exec_logged(database, it->first, sql, "removing files")) {
+            return false;
+        }
+    }
     return true;
 }
 
 void sql_remove_tags(sqlite3 *database, QStringList filenames, QStringList tags)
 {
+    TraceScope scope("sql_remove_tags");
     char *err;
-    std::string sql = std::string("DELETE FROM master WHERE path = '");
+    sqlite3_exec(database, "BEGIN", NULL, 0, NULL);
+    std::map<std::string, uint64_t> new_generations;
+    store_generations(database, schemas_of(filenames), &new_generations);
     for (int i = 0; i < filenames.size(); ++i) {
-        std::string sql_query = sql + sanitize_path(filenames.at(i).toStdString()) + "' AND tag = '";
+        std::string path = filenames.at(i).toStdString();
+        std::string sql_query = "DELETE FROM " + schema_for(path) + ".master WHERE path = '" + \
+                                sanitize_path(path) + "' AND tag = '";
         for (int j = 0; j < tags.size(); ++j) {
             std::string sql_final = sql_query + tags.at(j).toStdString() + "'";
             if (sqlite3_exec(database, sql_final.c_str(), NULL, 0, &err)) {
@@ -145,34 +1336,180 @@ void sql_remove_tags(sqlite3 *database, QStringList filenames, QStringList tags)
             }
         }
     }
+    if (!flush_changes(database)) {
+        std::cerr << "Error while logging tags: " << sqlite3_errmsg(database) << std::endl;
+    }
+    sqlite3_exec(database, "COMMIT", NULL, 0, NULL);
+    publish_generations(new_generations);
+}
+
+// Drops the changes after the given sequence number (at most count of
+// them) that a later change to the same path and tag, or a later removal
+// of the whole path, has made pointless. A removal of the whole path
+// only gives way to another one, since it also wins over older changes to
+// any of the tags on import. What an export contains and what wins on
+// import stays the same. Returns where to go on from, or -1 once
+// the end of the log is reached.
+int64_t sql_trim_changes(sqlite3 *database, QString schema, int64_t after, int64_t count) {
+    TraceScope scope("sql_trim_changes");
+    std::string name = schema.toStdString();
+    std::string sql = "DELETE FROM " + name + ".changes WHERE seq IN (SELECT seq FROM " + name + ".changes AS change " + \
+                      "WHERE seq > ?1 AND seq <= ?2 AND EXISTS (SELECT 1 FROM " + name + ".changes AS later " + \
+                      "WHERE later.path = change.path AND later.seq > change.seq AND later.time >= change.time " + \
+                      "AND (later.tag IS change.tag OR (later.tag IS NULL AND later.op = 0)) " + \
+                      "AND NOT (change.tag IS NULL AND change.op = 0 AND later.op = 1)))";
+    std::string end = "SELECT max(seq) FROM " + name + ".changes";
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(database, end.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+    int64_t last = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    if (after >= last) {
+        return -1;
+    }
+    if (sqlite3_prepare_v2(database, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+        return after;
+    }
+    sqlite3_bind_int64(stmt, 1, after);
+    sqlite3_bind_int64(stmt, 2, after + count);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? after + count : after;
 }
 
 QSet<QString> sql_update_entries(sqlite3 *database, QStringList tags, bool exact) {
+    TraceScope scope("sql_update_entries");
     char *err;
     QSet<QString> entries;
-    std::string sql = std::string("SELECT DISTINCT path FROM master ");
-    for (int i = 0; i < tags.size(); ++i) {
-        std::string tag = tags.at(i).toStdString();
-        bool exclude = false;
-        if (tags.at(i)[0] == '-') {
-            tag = tags.at(i).mid(1).toStdString();
-            exclude = true;
-        }
-        sql += exclude ? "EXCEPT " : "INTERSECT ";
-        if (exact) {
-            sql += "SELECT DISTINCT path FROM master WHERE tag = '" + tag + "' ";
-        } else {
-            sql += "SELECT DISTINCT path FROM master WHERE tag LIKE '%" + tag + "%' ";
-        }
-    }
+    std::string sql = entries_sql(tags, exact, "master");
     if (sqlite3_exec(database, sql.c_str(), path_callback, static_cast<void *>(&entries), &err)) {
         std::cerr << "Error while reading entries: " << err << std::endl;
         entries.clear();
     }
+    trace_record_query(scope.elapsed(), entries.size());
     return entries;
 }
 
+void sql_set_identities(sqlite3 *database, QHash<QString, fileIdentity> identities) {
+    TraceScope scope("sql_set_identities");
+    routedStatement insert = {"INSERT OR REPLACE INTO {to}.identity (path, size, quick, full) VALUES (?, ?, ?, ?)", {}};
+    sqlite3_exec(database, "BEGIN", NULL, 0, NULL);
+    for (auto it = identities.begin(); it != identities.end(); ++it) {
+        std::string path = it.key().toStdString();
+        sqlite3_stmt *stmt = route_statement(database, insert, path);
+        if (!stmt) {
+            std::cerr << "Error while storing identities: " << sqlite3_errmsg(database) << std::endl;
+            break;
+        }
+        sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, it->size);
+        sqlite3_bind_int64(stmt, 3, it->quick);
+        sqlite3_bind_int64(stmt, 4, it->full);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            std::cerr << "Error while storing identities: " << sqlite3_errmsg(database) << std::endl;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_exec(database, "COMMIT", NULL, 0, NULL);
+    finalize_routed(insert);
+}
+
+void sql_set_meta(sqlite3 *database, const char *key, int64_t value) {
+    std::string sql = "INSERT OR REPLACE INTO main.meta (key, value) VALUES ('" + std::string(key) + "', " + \
+                      std::to_string(value) + ")";
+    char *err;
+    if (sqlite3_exec(database, sql.c_str(), NULL, 0, &err)) {
+        std::cerr << "Error while storing " << key << ": " << err << std::endl;
+    }
+}
+
+void sql_set_meta_text(sqlite3 *database, const char *key, const std::string &value) {
+    if (!exec_bound(database, "INSERT OR REPLACE INTO main.meta (key, value) VALUES (?1, ?2)", {key, value})) {
+        std::cerr << "Error while storing " << key << ": " << sqlite3_errmsg(database) << std::endl;
+    }
+}
+
+// A file that changed gets another try at an identity if it couldn't be
+// hashed before.
+void sql_set_metadata(sqlite3 *database, QHash<QString, fileMetadata> metadata) {
+    TraceScope scope("sql_set_metadata");
+    if (metadata.isEmpty()) {
+        return;
+    }
+    routedStatement insert = {"INSERT OR REPLACE INTO {to}.metadata (path, size, mtime, type) VALUES (?, ?, ?, ?)", {}};
+    routedStatement retry = {"DELETE FROM {to}.identity WHERE path = ? AND size = 0", {}};
+    ++metadata_generation;
+    std::map<std::string, uint64_t> new_generations;
+    sqlite3_exec(database, "BEGIN", NULL, 0, NULL);
+    store_generations(database, schemas_of(metadata.keys()), &new_generations);
+    for (auto it = metadata.begin(); it != metadata.end(); ++it) {
+        std::string path = it.key().toStdString();
+        std::string type = it->type.toStdString();
+        sqlite3_stmt *stmt = route_statement(database, insert, path);
+        if (!stmt) {
+            std::cerr << "Error while storing metadata: " << sqlite3_errmsg(database) << std::endl;
+            break;
+        }
+        sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, it->size);
+        sqlite3_bind_int64(stmt, 3, it->mtime);
+        sqlite3_bind_text(stmt, 4, type.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            std::cerr << "Error while storing metadata: " << sqlite3_errmsg(database) << std::endl;
+        }
+        sqlite3_reset(stmt);
+        stmt = route_statement(database, retry, path);
+        if (stmt) {
+            sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+        }
+    }
+    sqlite3_exec(database, "COMMIT", NULL, 0, NULL);
+    finalize_routed(insert);
+    finalize_routed(retry);
+    publish_generations(new_generations);
+}
+
+// Only written down here. The shards are attached (and the rows moved to
+// them or back) the next time the program starts.
+// Returns false if not every root got a database, either because of an
+// error or because there are more than fit.
+bool sql_set_shards(sqlite3 *database, QStringList roots) {
+    TraceScope scope("sql_set_shards");
+    int limit = sql_get_shard_limit(database);
+    int stored = 0;
+    int wanted = 0;
+    const char *upsert = "INSERT INTO main.shards (root, file, enabled) VALUES (?1, ?2, 1) "
+                         "ON CONFLICT (root) DO UPDATE SET enabled = 1";
+    bool ok = sqlite3_exec(database, "BEGIN", NULL, 0, NULL) == SQLITE_OK;
+    ok = ok && sqlite3_exec(database, "UPDATE main.shards SET enabled = 0", NULL, 0, NULL) == SQLITE_OK;
+    for (int i = 0; i < roots.size() && ok; ++i) {
+        std::string root = roots.at(i).toStdString();
+        while (root.size() > 1 && root.back() == '/') {
+            root.pop_back();
+        }
+        // A shard for all of / would just be the main database again.
+        wanted += root.size() > 1;
+        if (root.size() > 1 && stored < limit) {
+            ok = exec_bound(database, upsert, {root, shard_file(root)});
+            ++stored;
+        } else if (root.size() > 1) {
+            std::cerr << "Too many databases, " << root << " stays in the main one" << std::endl;
+        }
+    }
+    ok = ok && sqlite3_exec(database, "COMMIT", NULL, 0, NULL) == SQLITE_OK;
+    if (!ok) {
+        std::cerr << "Error while storing shards: " << sqlite3_errmsg(database) << std::endl;
+        sqlite3_exec(database, "ROLLBACK", NULL, 0, NULL);
+        return false;
+    }
+    return stored == wanted;
+}
+
 void sql_write_database_contents(sqlite3 *database, std::string filename) {
+    TraceScope scope("sql_write_database_contents");
     YAML::Emitter yaml;
     sqlite3_stmt *stmt;
     std::string sql = std::string("SELECT DISTINCT path,tag FROM master GROUP BY path,tag");
@@ -0,0 +1,193 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+#define TRACE_BUFFER_SIZE 8192
+
+struct traceEvent {
+    const char *name;
+    int64_t start;
+    int64_t value;
+    bool counter;
+};
+
+// The same, for events that may be overwritten while trace_write reads
+// them. Relaxed atomics compile to plain loads and stores.
+struct traceSlot {
+    std::atomic<const char *> name;
+    std::atomic<int64_t> start;
+    std::atomic<int64_t> value;
+    std::atomic<bool> counter;
+};
+
+// Each thread only ever writes to its own buffer so recording an event
+// is just a few stores and an atomic increment. Older events are
+// overwritten once the buffer wraps around.
+struct traceBuffer {
+    traceSlot events[TRACE_BUFFER_SIZE];
+    std::atomic<uint64_t> head{0};
+    int tid;
+};
+
+static std::atomic<bool> trace_enabled{false};
+static std::string trace_filename;
+static std::mutex buffers_mutex;
+static std::vector<traceBuffer *> buffers;
+
+static std::atomic<int64_t> last_query_time{0};
+static std::atomic<int64_t> last_rows_returned{0};
+static std::atomic<int64_t> last_rows_materialized{0};
+
+static int64_t now() {
+    auto time = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+static traceBuffer *get_buffer() {
+    // Buffers are intentionally never freed so events from threads that
+    // have already exited still end up in the trace.
+    thread_local traceBuffer *buffer = nullptr;
+    if (!buffer) {
+        buffer = new traceBuffer;
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        buffer->tid = buffers.size() + 1;
+        buffers.push_back(buffer);
+    }
+    return buffer;
+}
+
+static void record_event(const char *name, int64_t start, int64_t value, bool counter) {
+    traceBuffer *buffer = get_buffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    traceSlot &event = buffer->events[head % TRACE_BUFFER_SIZE];
+    // Whoever sees any of the stores below also sees the head they come
+    // after, which is how trace_write tells what it may have torn.
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.value.store(value, std::memory_order_relaxed);
+    event.counter.store(counter, std::memory_order_relaxed);
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+TraceScope::TraceScope(const char *name) : name(name), start(now()) {
+}
+
+TraceScope::~TraceScope() {
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        record_event(name, start, elapsed(), false);
+    }
+}
+
+int64_t TraceScope::elapsed() const {
+    return now() - start;
+}
+
+void trace_counter(const char *name, int64_t value) {
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        record_event(name, now(), value, true);
+    }
+}
+
+traceStats trace_get_stats() {
+    traceStats stats;
+    stats.queryTime = last_query_time.load(std::memory_order_relaxed);
+    stats.rowsReturned = last_rows_returned.load(std::memory_order_relaxed);
+    stats.rowsMaterialized = last_rows_materialized.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void trace_init() {
+    const char *filename = getenv("FUSEN_TRACE");
+    if (filename && filename[0]) {
+        trace_filename = filename;
+        trace_enabled.store(true);
+    }
+}
+
+void trace_record_materialized(int64_t rows) {
+    last_rows_materialized.store(rows, std::memory_order_relaxed);
+    trace_counter("rows_materialized", rows);
+}
+
+void trace_record_query(int64_t duration, int64_t rows) {
+    last_query_time.store(duration, std::memory_order_relaxed);
+    last_rows_returned.store(rows, std::memory_order_relaxed);
+    trace_counter("rows_returned", rows);
+}
+
+void trace_write() {
+    if (!trace_enabled.load()) {
+        return;
+    }
+
+    std::ofstream fout(trace_filename);
+    if (!fout) {
+        std::cerr << "Error while writing trace file: " << trace_filename << std::endl;
+        return;
+    }
+
+    // Chrome trace-event format; timestamps are in microseconds.
+    fout << "{\"traceEvents\":[";
+    bool first = true;
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    for (traceBuffer *buffer : buffers) {
+        // Other threads may still be recording, so the events are copied
+        // out first. Any the thread could have started to overwrite in the
+        // meantime (the one at the head it is at now, and those before it
+        // that share its slot) are dropped.
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t begin = head > TRACE_BUFFER_SIZE ? head - TRACE_BUFFER_SIZE : 0;
+        std::vector<traceEvent> events;
+        events.reserve(head - begin);
+        for (uint64_t i = begin; i < head; ++i) {
+            const traceSlot &slot = buffer->events[i % TRACE_BUFFER_SIZE];
+            events.push_back({slot.name.load(std::memory_order_relaxed), slot.start.load(std::memory_order_relaxed),
+                              slot.value.load(std::memory_order_relaxed),
+                              slot.counter.load(std::memory_order_relaxed)});
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t current = buffer->head.load(std::memory_order_relaxed);
+        uint64_t torn = current + 1 > begin + TRACE_BUFFER_SIZE ? current + 1 - TRACE_BUFFER_SIZE - begin : 0;
+        for (size_t i = std::min<uint64_t>(torn, events.size()); i < events.size(); ++i) {
+            const traceEvent &event = events[i];
+            if (!first) {
+                fout << ",";
+            }
+            first = false;
+            fout << "{\"name\":\"" << event.name << "\",\"pid\":1,\"tid\":" << buffer->tid;
+            fout << ",\"ts\":" << event.start / 1000.0;
+            if (event.counter) {
+                fout << ",\"ph\":\"C\",\"args\":{\"value\":" << event.value << "}}";
+            } else {
+                fout << ",\"ph\":\"X\",\"dur\":" << event.value / 1000.0 << "}";
+            }
+        }
+    }
+    fout << "]}\n";
+    fout.close();
+}
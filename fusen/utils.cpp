@@ -14,33 +14,110 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <functional>
 #include <iostream>
 #include <pwd.h>
 #include <unistd.h>
+#include <unordered_map>
 
 #include "sql.h"
+#include "trace.h"
 #include "utils.h"
 
-QStringList getNewDirectoryFiles(QString directory, QSet<QString> existing_files, bool recursive) {
+// Metadata of the new files is read while walking so it never needs a
+// separate pass.
+static void add_new_file(const fs::directory_entry &p, QSet<QString> &existing_files, QStringList &filenames,
+                         QHash<QString, fileMetadata> *metadata) {
+    if (p.is_regular_file() and !existing_files.contains(p.path().string().c_str())) {
+        QString filename = p.path().string().c_str();
+        filenames.append(filename);
+        fileMetadata file_metadata;
+        if (metadata && readMetadata(filename, &file_metadata)) {
+            metadata->insert(filename, file_metadata);
+        }
+    }
+}
+
+// Files that are already in the database but that the rules of the scan
+// directory exclude. Every directory is only checked once.
+QStringList getExcludedFiles(QString directory, QSet<QString> existing_files, ScanFilter *filter) {
+    TraceScope scope("getExcludedFiles");
+    QStringList excluded;
+    std::string prefix = directory.toStdString();
+    if (filter->isEmpty() || prefix.empty()) {
+        return excluded;
+    }
+    if (prefix.back() != '/') {
+        prefix += '/';
+    }
+    std::unordered_map<std::string, bool> excluded_dirs;
+    std::function<bool(const std::string &)> is_excluded = [&](const std::string &relative) {
+        if (relative.empty()) {
+            return false;
+        }
+        auto it = excluded_dirs.find(relative);
+        if (it != excluded_dirs.end()) {
+            return it->second;
+        }
+        size_t slash = relative.rfind('/');
+        std::string parent = slash == std::string::npos ? std::string() : relative.substr(0, slash);
+        std::string name = slash == std::string::npos ? relative : relative.substr(slash + 1);
+        bool result = is_excluded(parent) || filter->excludesDirectory(name, relative);
+        excluded_dirs.emplace(relative, result);
+        return result;
+    };
+    for (auto i = existing_files.begin(), end = existing_files.end(); i != end; ++i) {
+        std::string path = i->toStdString();
+        if (path.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        std::string relative = path.substr(prefix.size());
+        size_t slash = relative.rfind('/');
+        std::string parent = slash == std::string::npos ? std::string() : relative.substr(0, slash);
+        std::string name = slash == std::string::npos ? relative : relative.substr(slash + 1);
+        if (is_excluded(parent) || !filter->includesFile(name, relative)) {
+            excluded.append(*i);
+        }
+    }
+    return excluded;
+}
+
+QStringList getNewDirectoryFiles(QString directory, QSet<QString> existing_files, bool recursive,
+                                 QHash<QString, fileMetadata> *metadata, ScanFilter *filter) {
+    TraceScope scope("getNewDirectoryFiles");
     QStringList filenames;
     if (!directory.isEmpty()) {
         fs::path path = fs::path(directory.toStdString());
-        if (recursive) {
-            for (auto& p: fs::recursive_directory_iterator(path)) {
-                if (p.is_regular_file() and !existing_files.contains(p.path().string().c_str())) {
-                    filenames.append(p.path().string().c_str());
+        if (recursive && filter && !filter->isEmpty()) {
+            // Excluded directories are skipped before they are opened, so
+            // nothing below them costs anything. Entry types come from the
+            // directory listing, so deciding doesn't need a stat either.
+            size_t prefix = path.string().size() + (path.string().back() == '/' ? 0 : 1);
+            for (auto it = fs::recursive_directory_iterator(path); it != fs::recursive_directory_iterator(); ++it) {
+                std::string relative = it->path().string().substr(prefix);
+                std::string name = it->path().filename().string();
+                if (it->is_directory()) {
+                    if (filter->excludesDirectory(name, relative)) {
+                        it.disable_recursion_pending();
+                    }
+                } else if (filter->includesFile(name, relative)) {
+                    add_new_file(*it, existing_files, filenames, metadata);
                 }
             }
+        } else if (recursive) {
+            for (auto& p: fs::recursive_directory_iterator(path)) {
+                add_new_file(p, existing_files, filenames, metadata);
+            }
         } else {
             for (auto& p: fs::directory_iterator(path)) {
-                if (p.is_regular_file() and !existing_files.contains(p.path().string().c_str())) {
-                    filenames.append(p.path().string().c_str());
-                }
+                add_new_file(p, existing_files, filenames, metadata);
             }
         }
     }
+    trace_counter("new_files", filenames.size());
     return filenames;
 }
 
@@ -51,6 +128,10 @@ fs::path getUserFile(const char *type) {
         filename = "data.sqlite";
     } else if (strcmp(type, "settings") == 0) {
         filename = "settings.yaml";
+    } else if (strcmp(type, "journal") == 0) {
+        filename = "tags.journal";
+    } else if (strcmp(type, "snapshot") == 0) {
+        filename = "index.snapshot";
     }
 
     assert(filename && filename[0]);
@@ -77,10 +158,29 @@ std::string sanitize_path(std::string str) {
     return str;
 }
 
-bool scanDirectories(sqlite3 *database, QString directory, QSet<QString> existing_files) {
-    QStringList filenames = getNewDirectoryFiles(directory, existing_files, true);
+std::string sanitize_tags(std::string str) {
+    // Replace some special characters and other nonsense for sanity
+    // An sql injection is probably still possible but whatever don't make drop table a tag
+    std::replace(str.begin(), str.end(), ' ', '_');
+    std::replace(str.begin(), str.end(), '\'', '_');
+    std::replace(str.begin(), str.end(), '"', '_');
+    return str;
+}
+
+bool scanDirectories(sqlite3 *database, QString directory, QSet<QString> existing_files, QStringList *added,
+                     const scanRules &rules) {
+    TraceScope scope("scanDirectories");
+    ScanFilter filter(rules);
+    QHash<QString, fileMetadata> metadata;
+    QStringList filenames = getNewDirectoryFiles(directory, existing_files, true, &metadata, &filter);
     if (!filenames.isEmpty()) {
-        return sql_add_paths(database, filenames);
+        if (!sql_add_paths(database, filenames)) {
+            return false;
+        }
+        sql_set_metadata(database, metadata);
+        if (added) {
+            *added += filenames;
+        }
     }
     return true;
 }
@@ -0,0 +1,262 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "sql.h"
+#include "utils.h"
+#include "writer.h"
+
+// How long to wait for more edits before committing, and how long to wait
+// before trying again after a commit failed for a reason that goes away.
+#define GROUP_COMMIT_DELAY std::chrono::milliseconds(100)
+#define RETRY_DELAY std::chrono::seconds(1)
+
+// Journal lines are "+" or "-", the path and the tag separated by tabs.
+static std::string escape_field(const QString &field) {
+    std::string str = field.toStdString();
+    std::string escaped;
+    for (char c : str) {
+        if (c == '\\') {
+            escaped += "\\\\";
+        } else if (c == '\t') {
+            escaped += "\\t";
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// Busy databases and full or failing disks may well recover, but anything
+// else would fail the same way every time, so those edits are given up.
+static bool is_transient(int error) {
+    return error == SQLITE_BUSY || error == SQLITE_LOCKED || error == SQLITE_FULL || error == SQLITE_IOERR;
+}
+
+static QString unescape_field(const std::string &field) {
+    std::string str;
+    for (size_t i = 0; i < field.size(); ++i) {
+        if (field[i] == '\\' && i + 1 < field.size()) {
+            ++i;
+            str += field[i] == 't' ? '\t' : field[i] == 'n' ? '\n' : field[i];
+        } else {
+            str += field[i];
+        }
+    }
+    return QString::fromStdString(str);
+}
+
+// The journal belongs to whoever holds the lock on it. Anyone else (the
+// command line while the window is open, or a second window) leaves it
+// alone, since replaying and truncating it would race with the appends of
+// its owner, and doesn't journal its own edits.
+TagWriter::TagWriter() : committing(false), failed(false), flushRequested(false), stopping(false) {
+    database = connectDatabase();
+    fs::path file = getUserFile("journal");
+    journal = open(file.string().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal < 0) {
+        std::cerr << "Error while opening tag journal: " << strerror(errno) << std::endl;
+    } else if (flock(journal, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) {
+            std::cerr << "The tag journal is in use by another instance, leaving it alone." << std::endl;
+        } else {
+            std::cerr << "Error while locking tag journal: " << strerror(errno) << std::endl;
+        }
+        close(journal);
+        journal = -1;
+    } else {
+        replayJournal();
+    }
+    thread = std::thread(&TagWriter::run, this);
+}
+
+TagWriter::~TagWriter() {
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cond.notify_all();
+    thread.join();
+    // Closing it releases the lock.
+    if (journal >= 0) {
+        close(journal);
+    }
+    sqlite3_close(database);
+}
+
+void TagWriter::enqueue(const QStringList &paths, const QStringList &tags, bool add) {
+    std::string lines;
+    for (int i = 0; i < paths.size(); ++i) {
+        for (int j = 0; j < tags.size(); ++j) {
+            lines += std::string(add ? "+" : "-") + "\t" + escape_field(paths.at(i)) + "\t" + escape_field(tags.at(j)) + "\n";
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // The edit only counts as accepted once it is on disk.
+    if (journal >= 0) {
+        size_t written = 0;
+        while (written < lines.size()) {
+            ssize_t ret = write(journal, lines.data() + written, lines.size() - written);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0) {
+                std::cerr << "Error while writing tag journal: " << strerror(errno) << std::endl;
+                break;
+            }
+            written += ret;
+        }
+        fdatasync(journal);
+    }
+    for (int i = 0; i < paths.size(); ++i) {
+        for (int j = 0; j < tags.size(); ++j) {
+            pending.insert(QPair<QString, QString>(paths.at(i), tags.at(j)), add);
+        }
+    }
+    cond.notify_one();
+}
+
+// Blocks until every queued edit is in the database. Returns false if a
+// commit failed in the meantime.
+bool TagWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    failed = false;
+    flushRequested = true;
+    cond.notify_one();
+    drained.wait(lock, [this] { return (pending.isEmpty() && !committing) || failed; });
+    flushRequested = false;
+    return !failed;
+}
+
+void TagWriter::replayJournal() {
+    fs::path file = getUserFile("journal");
+    std::ifstream fin(file.string().c_str());
+    if (!fin) {
+        return;
+    }
+    QHash<QPair<QString, QString>, bool> mutations;
+    int error;
+    std::string line;
+    while (std::getline(fin, line)) {
+        // A crash in the middle of a write leaves a partial last line.
+        if (fin.eof()) {
+            break;
+        }
+        size_t first = line.find('\t');
+        size_t second = first == std::string::npos ? first : line.find('\t', first + 1);
+        if (second == std::string::npos || (line[0] != '+' && line[0] != '-')) {
+            continue;
+        }
+        QString path = unescape_field(line.substr(first + 1, second - first - 1));
+        QString tag = unescape_field(line.substr(second + 1));
+        mutations.insert(QPair<QString, QString>(path, tag), line[0] == '+');
+    }
+    fin.close();
+
+    if (!mutations.isEmpty()) {
+        std::cerr << "Replaying " << mutations.size() << " unsaved tag edits." << std::endl;
+        if (!sql_apply_tag_mutations(database, mutations, &error)) {
+            if (is_transient(error)) {
+                // Keep the journal around for the next try.
+                return;
+            }
+            std::cerr << "Giving up on the unsaved tag edits." << std::endl;
+        }
+    }
+    fs::resize_file(file, 0);
+}
+
+// Edits that were accepted but aren't in the database yet, the ones being
+// committed right now included.
+QHash<QPair<QString, QString>, bool> TagWriter::uncommitted() {
+    std::lock_guard<std::mutex> lock(mutex);
+    QHash<QPair<QString, QString>, bool> edits = batch;
+    edits.insert(pending);
+    return edits;
+}
+
+void TagWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this] { return stopping || !pending.isEmpty(); });
+        if (pending.isEmpty()) {
+            return;
+        }
+        // Give more edits a moment to arrive so they share the transaction.
+        cond.wait_for(lock, GROUP_COMMIT_DELAY, [this] { return stopping || flushRequested; });
+
+        batch.swap(pending);
+        committing = true;
+        lock.unlock();
+        int error;
+        bool ok = sql_apply_tag_mutations(database, batch, &error);
+        lock.lock();
+        committing = false;
+
+        bool retry = !ok && is_transient(error);
+        if (!retry) {
+            // Everything that was ever journaled is in the database now
+            // (or never will be).
+            if (pending.isEmpty() && journal >= 0 && ftruncate(journal, 0) < 0) {
+                std::cerr << "Error while truncating tag journal: " << strerror(errno) << std::endl;
+            }
+        } else {
+            // Put the batch back unless the same pair was edited again since.
+            for (auto it = batch.begin(); it != batch.end(); ++it) {
+                if (!pending.contains(it.key())) {
+                    pending.insert(it.key(), it.value());
+                }
+            }
+        }
+        batch.clear();
+        if (!ok) {
+            failed = true;
+        }
+        drained.notify_all();
+
+        if (stopping) {
+            return;
+        }
+        if (!retry && committed) {
+            // A copy, so the callback can be replaced while it runs.
+            std::function<void(bool)> callback = committed;
+            lock.unlock();
+            callback(ok);
+            lock.lock();
+        } else if (retry) {
+            cond.wait_for(lock, RETRY_DELAY, [this] { return stopping; });
+        }
+    }
+}
+
+// Called on the writer thread after every commit, with false if the edits
+// were given up on.
+void TagWriter::setCommitted(std::function<void(bool)> callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    committed = callback;
+}
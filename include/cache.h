@@ -0,0 +1,46 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <cstdint>
+#include <QList>
+#include <QStringList>
+
+struct queryResult {
+    QStringList terms;
+    bool exact;
+    uint64_t generation;
+    QStringList entries;
+};
+
+// Small most-recently-used cache of search results. Every entry remembers
+// the database generation it was computed at and is ignored once the
+// database has been written to since.
+class QueryCache {
+    public:
+        explicit QueryCache(int capacity = 16);
+        void clear();
+        const queryResult *find(const QStringList &terms, bool exact, uint64_t generation);
+        const queryResult *findRefinable(const QStringList &terms, bool exact, uint64_t generation);
+        void insert(const QStringList &terms, bool exact, uint64_t generation, const QStringList &entries);
+    private:
+        int capacity;
+        QList<queryResult> results;
+};
+
+#endif
@@ -0,0 +1,50 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CHANGES_H
+#define CHANGES_H
+
+#include <cstdint>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <sqlite3.h>
+#include <string>
+
+// One entry of the change log. An empty tag means the path itself was
+// added or removed.
+struct tagChange {
+    bool add;
+    QString path;
+    int64_t seq;
+    QString tag;
+    int64_t time;
+};
+
+// Where an export left off, the last sequence number of every database by
+// name ("main" or the name of the shard file). Written out as the number
+// of main followed by ",name:number" for the others, so a plain number
+// still means main.
+typedef QHash<QString, int64_t> changeCursor;
+
+changeCursor parseChangeCursor(const std::string &text);
+std::string formatChangeCursor(const changeCursor &cursor);
+bool exportChangeLog(sqlite3 *database, const std::string &since, const std::string &filename, std::string *last);
+bool importChangeLog(sqlite3 *database, const std::string &filename, QStringList roots, int *applied, int *skipped);
+
+#endif
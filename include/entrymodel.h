@@ -0,0 +1,43 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ENTRYMODEL_H
+#define ENTRYMODEL_H
+
+#include <QAbstractListModel>
+#include <QStringList>
+
+#include "snapshot.h"
+
+// The list of paths shown in the main view. It either holds a list of its
+// own or reads the paths straight out of a snapshot, one row at a time as
+// the view asks for them, so showing the whole library at startup doesn't
+// need a string for every path.
+class EntryModel : public QAbstractListModel {
+    public:
+        explicit EntryModel(QObject *parent = 0);
+        QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+        int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+        void setSnapshot(const IndexSnapshot *snapshot);
+        void setStringList(const QStringList &entries);
+        bool showsSnapshot() const;
+    private:
+        QStringList entries;
+        const IndexSnapshot *snapshot;
+};
+
+#endif
@@ -0,0 +1,65 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FACETS_H
+#define FACETS_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <QPair>
+#include <QStringList>
+#include <sqlite3.h>
+
+#include "snapshot.h"
+#include "threadpool.h"
+
+// One count of the tags of a search result, most common first. With a
+// current snapshot the counts come from its posting lists, otherwise from
+// one grouped query. Without paths the whole library is counted.
+class FacetJob {
+    public:
+        FacetJob(const QStringList &paths, bool all, int limit, const IndexSnapshot *snapshot);
+        void cancel();
+        bool isCancelled() const;
+        QList<QPair<int, QString>> result() const;
+        void run(sqlite3 *database);
+    private:
+        bool all;
+        std::atomic<bool> cancelled;
+        QList<QPair<int, QString>> facets;
+        int limit;
+        QStringList paths;
+        const IndexSnapshot *snapshot;
+};
+
+// Runs facet jobs on the thread pool, on a connection of its own so
+// counting never holds up the window. Jobs take turns on the connection,
+// and one that was cancelled in the meantime stops early.
+class FacetCounter {
+    public:
+        explicit FacetCounter(ThreadPool *pool);
+        ~FacetCounter();
+        void start(std::shared_ptr<FacetJob> job, std::function<void()> finished);
+    private:
+        sqlite3 *database;
+        std::mutex mutex;
+        ThreadPool *pool;
+};
+
+#endif
@@ -0,0 +1,60 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <QSet>
+#include <QStringList>
+
+#include "match.h"
+#include "shards.h"
+#include "threadpool.h"
+
+// Evaluates a search over a sorted list of candidate paths. The tags are
+// looked up first, on the thread pool, and then the candidates are split
+// into chunks that are filtered in parallel. A search that isn't exact
+// keeps the paths whose name or tags match, an exact one only those with
+// all of the tags. Since every chunk is a contiguous slice of sorted
+// input, the merged result is just the chunk results in order and never
+// needs to be sorted again.
+class FilterJob : public std::enable_shared_from_this<FilterJob> {
+    public:
+        FilterJob(const QStringList &candidates, const QStringList &terms, bool exact);
+        void cancel();
+        void start(ThreadPool *pool, ShardSet *shards, std::function<void()> chunkFinished);
+        bool takeReady(QStringList &out);
+    private:
+        void evaluate(size_t chunk);
+        void filter(ThreadPool *pool, std::function<void()> chunkFinished);
+        QStringList candidates;
+        std::atomic<bool> cancelled;
+        bool exact;
+        std::vector<char> finished;
+        PathMatcher matcher;
+        std::mutex mutex;
+        size_t nextChunk;
+        std::vector<QStringList> results;
+        QSet<QString> tagEntries;
+        QStringList terms;
+};
+
+#endif
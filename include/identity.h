@@ -0,0 +1,71 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef IDENTITY_H
+#define IDENTITY_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QStringList>
+#include <sqlite3.h>
+
+#include "threadpool.h"
+
+// Content identity of a file. The quick hash only covers the first and
+// last block plus the size. The full hash is only computed (non-zero)
+// when another file has the same quick identity.
+struct fileIdentity {
+    int64_t size;
+    uint64_t quick;
+    uint64_t full;
+};
+
+// Gives every file that doesn't have an identity yet one, a batch at a
+// time on the thread pool and on a connection of its own, so a large
+// library doesn't hold up the start. Only as many batches are queued as
+// there are workers, so other jobs still get their turn. Progress is
+// reported from the pool as the number of files done out of all of them.
+class IdentityBackfill {
+    public:
+        explicit IdentityBackfill(ThreadPool *pool);
+        ~IdentityBackfill();
+        void cancel();
+        bool isRunning() const;
+        void start(std::function<void(int, int)> progress);
+    private:
+        void runBatch();
+        std::atomic<bool> cancelled;
+        sqlite3 *database;
+        int done;
+        std::mutex mutex;
+        int next;
+        QStringList paths;
+        ThreadPool *pool;
+        std::function<void(int, int)> progress;
+        std::atomic<bool> running;
+};
+
+QList<QPair<QString, QString>> findMovedFiles(sqlite3 *database, ThreadPool *pool, QStringList missing, QStringList added);
+bool hashFile(const std::string &path, bool full, fileIdentity *identity);
+QHash<QString, fileIdentity> hashFiles(ThreadPool *pool, QStringList paths);
+void updateIdentities(sqlite3 *database, ThreadPool *pool, QStringList paths);
+
+#endif
@@ -0,0 +1,47 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMPLICATIONS_H
+#define IMPLICATIONS_H
+
+#include <QDialog>
+#include <QLineEdit>
+#include <QListWidget>
+#include <QWidget>
+#include <sqlite3.h>
+
+#include "writer.h"
+
+class ImplicationsWidget : public QWidget {
+    public:
+        explicit ImplicationsWidget(sqlite3 *dbase, TagWriter *writer, QWidget *parent = 0);
+
+    private:
+        void refresh();
+        sqlite3 *database;
+        QDialog *implicationDialog;
+        QListWidget *implicationList;
+        QLineEdit *impliedEdit;
+        QLineEdit *tagEdit;
+        TagWriter *tagWriter;
+
+    private slots:
+        void addImplication();
+        void cancel();
+        void removeImplication();
+};
+
+#endif
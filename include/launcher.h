@@ -0,0 +1,56 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LAUNCHER_H
+#define LAUNCHER_H
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+#include <QHash>
+#include <QMimeDatabase>
+#include <QStringList>
+#include <QTimer>
+
+#include "utils.h"
+
+// Opens files in external viewers. Commands are started directly with
+// posix_spawn (no shell involved) and finished children are reaped from
+// a timer on the GUI thread. Files are grouped by the handler configured
+// for their MIME type and mpv instances started by fusen are reused over
+// their IPC socket.
+class Launcher {
+    public:
+        explicit Launcher(mainSettings *settings);
+        ~Launcher();
+        void openFiles(const QStringList &files);
+        void openFilesWith(const QString &command, const QStringList &files);
+    private:
+        QString handlerFor(const QString &file);
+        void launch(const QString &command, const QStringList &files);
+        void reapChildren();
+        int sendToMpv(const QStringList &files);
+        pid_t spawn(const QStringList &argv);
+        std::vector<pid_t> children;
+        QHash<QString, QString> mimeCache;
+        QMimeDatabase mimeDatabase;
+        pid_t mpvPid;
+        std::string mpvSocket;
+        QTimer *reaper;
+        mainSettings *settings;
+};
+
+#endif
@@ -0,0 +1,66 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+
+#include <cstdint>
+#include <QList>
+#include <QStringList>
+#include <sqlite3.h>
+
+// Page counts of one database. Free pages are still part of the file but
+// hold nothing.
+struct databaseStats {
+    int64_t freePages;
+    bool incremental;
+    int64_t pageSize;
+    int64_t pages;
+    QString schema;
+};
+
+// Keeps the databases from going stale or fragmented. A round drops
+// change log entries that later ones made pointless, refreshes the
+// planner statistics of every database that grew or shrank enough, hands free pages back to
+// the file system, checkpoints the write-ahead logs and lets SQLite
+// optimize whatever else it wants to. The work is done in slices of
+// bounded length on a connection of its own that never waits for a lock,
+// so anything busy is just tried again in the next slice. It can be used
+// from any thread, as long as only one uses it at a time.
+class Maintenance {
+    public:
+        Maintenance();
+        ~Maintenance();
+        void finish();
+        QList<databaseStats> stats();
+        bool step(int64_t budget);
+    private:
+        bool analyze(const QString &schema);
+        bool checkpoint(const QString &schema, int mode);
+        bool stale(const QString &schema);
+        int64_t trim(const QString &schema, int64_t from);
+        int64_t usedPages(const QString &schema);
+        bool vacuum(const QString &schema, int pages);
+        sqlite3 *database;
+        int schema;
+        QStringList schemas;
+        int stage;
+        int64_t trimFrom;
+        int64_t trimUntil;
+};
+
+#endif
@@ -17,49 +17,114 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include <atomic>
+#include <memory>
 #include <QCheckBox>
+#include <QLabel>
 #include <QLineEdit>
+#include <QListWidget>
 #include <QMainWindow>
-#include <QStringListModel>
+#include <QTimer>
 #include <sqlite3.h>
 
+#include "cache.h"
+#include "entrymodel.h"
+#include "facets.h"
+#include "filter.h"
+#include "identity.h"
+#include "launcher.h"
+#include "maintenance.h"
+#include "metadata.h"
+#include "shards.h"
+#include "snapshot.h"
+#include "threadpool.h"
 #include "utils.h"
+#include "writer.h"
 
 class MainWindow : public QMainWindow {
     public:
         explicit MainWindow(QWidget *parent = 0);
     private:
         QAction *clearTags;
+        bool closing;
         sqlite3 *database;
         QDialog *defaultOpen;
         QLineEdit *defaultOpenWith;
         QAction *deleteImport;
         QStringList entries;
         QCheckBox *exactMatch;
+        FacetCounter *facetCounter;
+        std::shared_ptr<FacetJob> facetJob;
+        QListWidget *facetList;
+        QTimer *facetTimer;
+        bool filterExact;
+        uint64_t filterGeneration;
+        std::shared_ptr<FilterJob> filterJob;
+        metadataQuery filterQuery;
+        bool filterShown;
+        QStringList filterTerms;
+        IdentityBackfill *identityBackfill;
+        QStringList library;
+        uint64_t libraryGeneration;
+        Launcher *launcher;
         QListView *listView;
-        QStringListModel *model;
+        Maintenance *maintenance;
+        bool maintenanceRunning;
+        QList<databaseStats> maintenanceStats;
+        QTimer *maintenanceTimer;
+        MetadataColumns *metadata;
+        EntryModel *model;
         QDialog *openWith;
         QLineEdit *openWithEntry;
+        QLabel *perfLabel;
+        QAction *perfOverlay;
+        ThreadPool *pool;
+        QueryCache *queryCache;
         QLineEdit *searchBox;
         mainSettings *settings;
+        QAction *shardDatabases;
+        ShardSet *shards;
+        IndexSnapshot *snapshot;
+        std::atomic<uint64_t> snapshotGeneration;
+        bool snapshotRunning;
         QDialog *tagDialog;
         QLineEdit *tagEdit;
+        TagWriter *tagWriter;
+        QAction *trackIdentity;
     private slots:
         void addDirectory(bool recursive);
         void addFiles();
         void addScanDirs();
         void buildEntries(const QString str);
         void closeEvent(QCloseEvent *event);
+        void collectEntries(std::shared_ptr<FilterJob> job);
         void copyPath();
         void defaultApplicationOpen();
+        void editImplications();
+        void exportChanges();
         void exportTags();
+        void importChanges();
         void importTags();
+        void loadEntries();
         void openFiles(bool defaultApplication);
         void openFilesWith();
+        void refineFacet(QListWidgetItem *item);
         void removeFiles();
+        void runMaintenance();
+        void showEdits();
+        void showEntries();
+        void showFacets(std::shared_ptr<FacetJob> job);
+        void showIdentityProgress(int done, int total);
+        void showMaintenance(bool more, QList<databaseStats> stats);
         void tagFiles();
+        void tagsCommitted(bool ok);
+        void toggleIdentity(bool checked);
+        void togglePerfOverlay(bool checked);
+        void toggleShards(bool checked);
         void updateApplication(bool update);
         void updateEntries(bool checked);
+        void updateFacets();
+        void updatePerfOverlay();
         void updateTags(bool add);
 };
 
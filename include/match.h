@@ -0,0 +1,44 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <string>
+#include <vector>
+#include <QStringList>
+
+typedef int (*matchKernel)(const char16_t *str, size_t len, const std::vector<std::u16string> &needles, size_t max_len);
+
+// Case-insensitive "contains any of these terms" matcher for paths. It is
+// equivalent to path.toLower().contains(term.toLower()) for any term but
+// works directly on the QString data. ASCII is folded with SSE2/AVX2 where
+// available and only paths with non-ASCII characters go through the full
+// Unicode toLower().
+class PathMatcher {
+    public:
+        explicit PathMatcher(const QStringList &terms);
+        bool isEmpty() const;
+        bool matches(const QString &path) const;
+    private:
+        std::vector<std::u16string> asciiNeedles;
+        matchKernel kernel;
+        bool matchEverything;
+        size_t maxLength;
+        QStringList unicodeNeedles;
+};
+
+#endif
@@ -0,0 +1,90 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <cstdint>
+#include <vector>
+#include <QList>
+#include <QStringList>
+#include <sqlite3.h>
+
+// What the scanner records about a file so it can be filtered and sorted
+// on without a stat. The type is the top level of the MIME type (video,
+// image, text, ...) guessed from the file name.
+struct fileMetadata {
+    int64_t size;
+    int64_t mtime;
+    QString type;
+};
+
+enum metadataField {
+    FIELD_NONE,
+    FIELD_MTIME,
+    FIELD_PATH,
+    FIELD_SIZE,
+    FIELD_TYPE,
+};
+
+enum metadataOperator {
+    OP_EQUAL,
+    OP_GREATER,
+    OP_GREATER_EQUAL,
+    OP_LESS,
+    OP_LESS_EQUAL,
+};
+
+struct metadataFilter {
+    metadataField field;
+    metadataOperator op;
+    bool negate;
+    QString type;
+    int64_t value;
+};
+
+// The metadata terms of a search (size>1G, mtime<2024-01-01, type:video,
+// sort:-size) with everything else left to the tag search.
+struct metadataQuery {
+    bool descending;
+    QList<metadataFilter> filters;
+    metadataField sort;
+};
+
+// Metadata of every path in the database held as columns, sorted by path
+// so looking up a sorted list of entries is a single merge.
+class MetadataColumns {
+    public:
+        MetadataColumns();
+        void apply(QStringList &entries, const metadataQuery &query) const;
+        bool isCurrent(uint64_t generation) const;
+        void load(sqlite3 *database, uint64_t generation);
+    private:
+        bool loaded;
+        uint64_t loadedGeneration;
+        std::vector<int64_t> mtimes;
+        QStringList paths;
+        std::vector<int64_t> sizes;
+        QStringList typeNames;
+        std::vector<uint16_t> types;
+};
+
+bool isMetadataTerm(const QString &term);
+metadataQuery parseMetadataQuery(const QStringList &terms, QStringList *tags);
+bool readMetadata(const QString &path, fileMetadata *metadata);
+QString typeClass(const QString &path);
+
+#endif
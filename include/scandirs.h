@@ -18,27 +18,34 @@
 #define SCANDIRS_H
 
 #include <QDialog>
+#include <QLineEdit>
 #include <QListWidget>
 #include <QWidget>
 #include <sqlite3.h>
 
 #include "mainwindow.h"
 #include "utils.h"
+#include "writer.h"
 
 class ScanDirsWidget : public QWidget {
     public:
-        explicit ScanDirsWidget(sqlite3 *dbase, mainSettings *set, QWidget *parent = 0);
+        explicit ScanDirsWidget(sqlite3 *dbase, mainSettings *set, TagWriter *writer, QWidget *parent = 0);
 
     private:
         mainSettings *settings;
         sqlite3 *database;
+        QLineEdit *excludeEdit;
+        QLineEdit *includeEdit;
         QDialog *scanDialog;
         QListWidget *scanList;
+        TagWriter *tagWriter;
 
     private slots:
         void addDirectory();
         void cancel();
         void removeDirectory();
+        void saveRules();
+        void showRules(QListWidgetItem *item);
     //    void itemSelected( int item );
 };
 
@@ -0,0 +1,79 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCANFILTER_H
+#define SCANFILTER_H
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <QStringList>
+
+// Glob rules of a scan directory. Patterns without a slash match file and
+// directory names anywhere below it, ones with a slash match the path
+// relative to it (a leading slash only anchors), and a trailing slash
+// limits a pattern to directories. If there are include patterns, only
+// files matching one of them are added.
+struct scanRules {
+    QStringList exclude;
+    QStringList include;
+};
+
+// Any number of glob patterns compiled into a single automaton. It is a
+// DFA built lazily from the combined NFA of all patterns, so matching is
+// one table lookup per character no matter how many patterns there are.
+// match() returns the flags of every pattern that matches.
+class GlobAutomaton {
+    public:
+        GlobAutomaton();
+        void add(const std::string &pattern, uint8_t flags);
+        uint8_t match(const std::string &text);
+    private:
+        struct globToken {
+            uint8_t kind;
+            uint8_t literal;
+            uint8_t flags;
+            std::bitset<256> set;
+        };
+        int addState(std::vector<uint32_t> &positions);
+        void enter(std::vector<uint32_t> &positions, uint32_t position) const;
+        void flush();
+        int step(int state, uint8_t c);
+        std::vector<uint32_t> starts;
+        std::map<std::vector<uint32_t>, int> stateIds;
+        std::vector<uint8_t> stateFlags;
+        std::vector<std::vector<uint32_t>> states;
+        std::vector<globToken> tokens;
+        std::vector<std::array<int32_t, 256>> transitions;
+};
+
+class ScanFilter {
+    public:
+        explicit ScanFilter(const scanRules &rules);
+        bool excludesDirectory(const std::string &name, const std::string &relative);
+        bool includesFile(const std::string &name, const std::string &relative);
+        bool isEmpty() const;
+    private:
+        bool empty;
+        bool hasIncludes;
+        GlobAutomaton names;
+        GlobAutomaton paths;
+};
+
+#endif
@@ -0,0 +1,49 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <QSet>
+#include <QStringList>
+#include <sqlite3.h>
+
+#include "threadpool.h"
+
+// Runs tag queries against every database of the sharded layout at once.
+// Each database gets a read-only connection of its own (the shards with
+// the main database attached, for the implication rules) and a task on
+// the thread pool, and the results are merged. The shards split the paths
+// between them, so nothing has to be deduplicated. Without shards it just
+// queries the main database, still on a connection of its own so the
+// window's one is never used from the pool.
+class ShardSet {
+    public:
+        ShardSet(sqlite3 *database, ThreadPool *pool);
+        ~ShardSet();
+        void start(const QStringList &tags, bool exact, const std::atomic<bool> *cancelled,
+                   std::function<void(QSet<QString>)> finished);
+    private:
+        std::vector<sqlite3 *> connections;
+        sqlite3 *database;
+        ThreadPool *pool;
+};
+
+#endif
@@ -0,0 +1,56 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <atomic>
+#include <cstdint>
+#include <QPair>
+#include <QStringList>
+#include <sqlite3.h>
+
+#include "utils.h"
+
+// Read-only, memory-mapped copy of the database contents. It holds every
+// path (sorted, so the index of a path is its id) and a sorted list of
+// path ids for every tag. A snapshot is only used if it was written at
+// the current database generation. Loading maps the file and reads it
+// through once to check it against its checksums.
+class IndexSnapshot {
+    public:
+        IndexSnapshot();
+        ~IndexSnapshot();
+        uint64_t count() const;
+        QList<QPair<int, QString>> countTags(const QStringList &paths, bool all, int limit,
+                                             const std::atomic<bool> *cancelled) const;
+        QStringList exactMatch(const QStringList &tags) const;
+        int64_t find(const QString &path) const;
+        uint64_t generation() const;
+        bool isValid() const;
+        bool load(const fs::path &file, uint64_t generation);
+        QString path(uint64_t id) const;
+        QStringList paths() const;
+    private:
+        void unload();
+        const uint32_t *posting(const std::string &tag, uint64_t *count) const;
+        const char *data;
+        size_t size;
+};
+
+bool writeSnapshot(sqlite3 *database, const fs::path &file, uint64_t generation);
+
+#endif
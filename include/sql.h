@@ -17,19 +17,58 @@
 #ifndef SQL_H
 #define SQL_H
 
+#include <atomic>
+#include <QHash>
+#include <QPair>
 #include <QSet>
 #include <QStringList>
 #include <sqlite3.h>
 #include <yaml-cpp/yaml.h>
 
+#include "changes.h"
+#include "identity.h"
+#include "metadata.h"
+
 sqlite3 *connectDatabase();
 void sql_add_columns(sqlite3 *database, std::string key, QStringList columns);
+bool sql_add_implication(sqlite3 *database, QString tag, QString implied);
 bool sql_add_paths(sqlite3 *database, QStringList paths);
 void sql_add_tags(sqlite3 *database, QStringList filenames, QStringList tags);
+bool sql_apply_changes(sqlite3 *database, QList<tagChange> changes, QStringList roots, int *applied, int *skipped);
+bool sql_apply_tag_mutations(sqlite3 *database, QHash<QPair<QString, QString>, bool> mutations, int *error);
 void sql_clear_tags(sqlite3 *database, QStringList filenames);
+QList<QPair<int, QString>> sql_count_tags(sqlite3 *database, QStringList paths, bool all, int limit,
+                                          const std::atomic<bool> *cancelled);
+QHash<QString, fileIdentity> sql_find_identities(sqlite3 *database, int64_t size, uint64_t quick);
+bool sql_forget_paths(sqlite3 *database, QStringList paths);
+QList<tagChange> sql_get_changes(sqlite3 *database, const changeCursor &since, changeCursor *last);
+uint64_t sql_get_generation();
+QList<QPair<QString, QString>> sql_get_implications(sqlite3 *database);
+QHash<QString, fileIdentity> sql_get_identities(sqlite3 *database, QStringList paths);
+int64_t sql_get_last_change(sqlite3 *database);
+int64_t sql_get_meta(sqlite3 *database, const char *key);
+std::string sql_get_meta_text(sqlite3 *database, const char *key);
+QHash<QString, fileMetadata> sql_get_metadata(sqlite3 *database);
+uint64_t sql_get_metadata_generation();
 QSet<QString> sql_get_paths(sqlite3 *database);
+QStringList sql_get_schemas();
+QStringList sql_get_shard_files();
+int sql_get_shard_limit(sqlite3 *database);
+QStringList sql_get_shard_roots();
+QSet<QString> sql_get_tagged_paths(sqlite3 *database);
+QStringList sql_get_unidentified_paths(sqlite3 *database);
+QSet<QString> sql_match_edits(sqlite3 *database, QHash<QPair<QString, QString>, bool> edits, QStringList tags,
+                              bool exact);
+bool sql_move_paths(sqlite3 *database, QList<QPair<QString, QString>> moves);
+bool sql_remove_implication(sqlite3 *database, QString tag, QString implied);
 bool sql_remove_paths(sqlite3 *database, QStringList paths);
 void sql_remove_tags(sqlite3 *database, QStringList filenames, QStringList tags);
+void sql_set_identities(sqlite3 *database, QHash<QString, fileIdentity> identities);
+void sql_set_meta(sqlite3 *database, const char *key, int64_t value);
+void sql_set_meta_text(sqlite3 *database, const char *key, const std::string &value);
+void sql_set_metadata(sqlite3 *database, QHash<QString, fileMetadata> metadata);
+bool sql_set_shards(sqlite3 *database, QStringList roots);
+int64_t sql_trim_changes(sqlite3 *database, QString schema, int64_t after, int64_t count);
 QSet<QString> sql_update_entries(sqlite3 *database, QStringList tags, bool exact);
 void sql_write_database_contents(sqlite3 *database, std::string filename);
 
@@ -0,0 +1,44 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run submitted tasks in FIFO order. The
+// destructor drops anything still queued and joins the workers.
+class ThreadPool {
+    public:
+        explicit ThreadPool(int threads = 0);
+        ~ThreadPool();
+        int size() const;
+        void submit(std::function<void()> task);
+    private:
+        void run();
+        std::condition_variable cond;
+        std::mutex mutex;
+        bool stopping;
+        std::deque<std::function<void()>> tasks;
+        std::vector<std::thread> workers;
+};
+
+#endif
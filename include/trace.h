@@ -0,0 +1,49 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+
+// Figures shown in the performance overlay. Times are in nanoseconds.
+struct traceStats {
+    int64_t queryTime;
+    int64_t rowsReturned;
+    int64_t rowsMaterialized;
+};
+
+// Records the time spent between construction and destruction as a
+// complete event in the calling thread's ring buffer. The name must
+// be a string literal (or otherwise outlive the program).
+class TraceScope {
+    public:
+        explicit TraceScope(const char *name);
+        ~TraceScope();
+        int64_t elapsed() const;
+    private:
+        const char *name;
+        int64_t start;
+};
+
+void trace_counter(const char *name, int64_t value);
+traceStats trace_get_stats();
+void trace_init();
+void trace_record_materialized(int64_t rows);
+void trace_record_query(int64_t duration, int64_t rows);
+void trace_write();
+
+#endif
@@ -19,21 +19,34 @@
 
 #include <filesystem>
 #include <QAction>
+#include <QHash>
 #include <QSet>
 #include <QStringList>
 
+#include "metadata.h"
+#include "scanfilter.h"
+
 struct mainSettings {
     QAction *clearTags;
     QAction *deleteImport;
     std::string defaultApplicationPath;
+    QHash<QString, QString> mimeHandlers;
+    QAction *perfOverlay;
+    QHash<QString, scanRules> scanDirRules;
     QStringList scanDirs;
+    QAction *shardDatabases;
+    QAction *trackIdentity;
 };
 
 namespace fs = std::filesystem;
 
 fs::path getUserFile(const char *type);
-QStringList getNewDirectoryFiles(QString directory, QSet<QString> existing_files, bool recursive);
+QStringList getExcludedFiles(QString directory, QSet<QString> existing_files, ScanFilter *filter);
+QStringList getNewDirectoryFiles(QString directory, QSet<QString> existing_files, bool recursive,
+                                 QHash<QString, fileMetadata> *metadata = nullptr, ScanFilter *filter = nullptr);
 std::string sanitize_path(std::string str);
-bool scanDirectories(sqlite3 *database, QString directory, QSet<QString> existing_files);
+std::string sanitize_tags(std::string str);
+bool scanDirectories(sqlite3 *database, QString directory, QSet<QString> existing_files, QStringList *added = nullptr,
+                     const scanRules &rules = scanRules());
 
 #endif
@@ -0,0 +1,61 @@
+/* This file is a part of fusen.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <QHash>
+#include <QPair>
+#include <QStringList>
+#include <sqlite3.h>
+
+// Applies tag edits in the background. Edits are appended to a journal
+// (so they survive a crash) and queued, and a writer thread with its own
+// database connection commits whatever has queued up in one transaction.
+// Only the last edit of every (path, tag) pair is kept, so adding and then
+// removing a tag before it is written costs nothing extra. Until they are
+// committed the edits can be asked for, to show them right away.
+class TagWriter {
+    public:
+        TagWriter();
+        ~TagWriter();
+        void enqueue(const QStringList &paths, const QStringList &tags, bool add);
+        bool flush();
+        void setCommitted(std::function<void(bool)> callback);
+        QHash<QPair<QString, QString>, bool> uncommitted();
+    private:
+        void replayJournal();
+        void run();
+        QHash<QPair<QString, QString>, bool> batch;
+        std::function<void(bool)> committed;
+        bool committing;
+        std::condition_variable cond;
+        sqlite3 *database;
+        std::condition_variable drained;
+        bool failed;
+        bool flushRequested;
+        int journal;
+        std::mutex mutex;
+        QHash<QPair<QString, QString>, bool> pending;
+        bool stopping;
+        std::thread thread;
+};
+
+#endif